@@ -3,7 +3,11 @@
 #include <stdio.h>
 #include <cmath>
 #include <vector>
+#include <algorithm>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <stdint.h>
 #include <SDL/SDL.h>
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
@@ -12,9 +16,19 @@
 #include <errno.h>
 #include <string.h>
 
+#include "cpu.h"
+
+using namespace cpu;
+
 SDL_Surface *surface;
-bool done = false;
-bool is_active = true;
+std::atomic<bool> done(false);
+std::atomic<bool> is_active(true);
+
+/* step and draw in turns on one thread instead of a simulation thread */
+bool lockstep = false;
+
+/* steps per second of the simulation thread, 0 runs it as fast as it can */
+double simulation_rate = 60.0;
 
 void
 init_sdl ()
@@ -69,311 +83,251 @@ init_opengl ()
 	resize_viewport();
 }
 
-class Vector2
+void
+draw_scene (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
 {
-	public:
-		Vector2 (float _x = 0.0f, float _y = 0.0f)
-		{
-			x = _x;
-			y = _y;
-		}
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 
-		float
-		length ()
-		{
-			return sqrtf(x*x + y*y);
-		}
+	for (auto& m : _swarm)
+		m.draw();
 
-		float x;
-		float y;	
-};
+	_dragonfly.draw();
+}
 
-class Mosquito
+/* Step, hunt and draw in turns on one thread. */
+void
+lockstep_loop (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
 {
-	public:
-		Vector2 velocity;
-		Vector2 position;
+	is_active = true;
+	SDL_Event event;
 
-		static Mosquito
-		random ()
+	while (!done)
+	{
+		while (SDL_PollEvent(&event))
 		{
-			Mosquito m;
+			switch (event.type)
+			{
+				case SDL_ACTIVEEVENT:
+					if (event.active.state == SDL_APPACTIVE )
+						is_active = (event.active.gain != 0);
+				break;
 
-			m.velocity.x = (float)(rand() % 1000) / 1000.0f - 0.5f;
-			m.velocity.y = (float)(rand() % 1000) / 1000.0f - 0.5f;
+				case SDL_QUIT:
+					done = true; 
+				break;
 
-			if (rand() % 2 == 0)
-			{
-				m.position.x = (float)(rand() % 300);
-				m.position.y = (float)(rand() % 300);
-			}
-			else
-			{
-				m.position.x = (float)(rand() % 300) + 300;
-				m.position.y = (float)(rand() % 300) + 300;
+				default:
+				break;
 			}
-
-			return m;
 		}
 
-		void
-		draw ()
+			
+		if (is_active)
 		{
-			glLoadIdentity();
-			glColor3ub(0, 99, 0);
-
-			glTranslatef(position.x, position.y, 0.0f);
-			glRotatef(atan2(velocity.y, velocity.x) * 180.0f / M_PI + 90.0f, 0.0f, 0.0f, 1.0f);
-
-			glBegin(GL_QUADS);
-				glVertex2f(-2.0f, -6.0f);
-				glVertex2f( 2.0f, -6.0f);
-				glVertex2f( 2.0f,  6.0f);
-				glVertex2f(-2.0f,  6.0f);
-			glEnd();
-		}
+			_swarm = step(_swarm, _dragonfly);
+			move_dragonfly(_dragonfly, _swarm);
 
-};
+			draw_scene(_swarm, _dragonfly);
+			SDL_GL_SwapBuffers();
+		}
+	}
+}
 
-class Dragonfly
+/* Lock-free triple buffer between one writer and one reader. The writer fills
+ * back() and publishes it, the reader takes the latest published slot with
+ * acquire() and keeps it in front() until it acquires again. Neither side
+ * ever waits for the other: the third slot holds the latest published state
+ * while the other two are in use. */
+template <typename T>
+class TripleBuffer
 {
 	public:
-		Vector2 velocity;
-		Vector2 position;
-
-		static Dragonfly 
-		random ()
+		TripleBuffer ()
 		{
-			Dragonfly d;
-
-			d.velocity.x = (float)(rand() % 1000) / 1000.0f - 0.5f;
-			d.velocity.y = (float)(rand() % 1000) / 1000.0f - 0.5f;
-			d.position.x = (float)(rand() % 600);
-			d.position.y = (float)(rand() % 600);
+			writer = 0;
+			ready = 1;
+			reader = 2;
+		}
 
-			return d;
+		T&
+		back ()
+		{
+			return slots[writer];
 		}
 
 		void
-		draw ()
+		publish ()
 		{
-			glLoadIdentity();
-			glColor3ub(111, 0, 0);
-
-			glTranslatef(position.x, position.y, 0.0f);
-			glRotatef(atan2(velocity.y, velocity.x) * 180.0f / M_PI + 90.0f, 0.0f, 0.0f, 1.0f);
-
-			glBegin(GL_QUADS);
-				glVertex2f(-4.0f, -8.0f);
-				glVertex2f( 4.0f, -8.0f);
-				glVertex2f( 4.0f,  8.0f);
-				glVertex2f(-4.0f,  8.0f);
-			glEnd();
+			writer = ready.exchange(writer | FRESH, std::memory_order_acq_rel)
+			    & INDEX;
 		}
-};
-
-Vector2
-operator+ (Vector2 const& _a, Vector2 const& _b)
-{
-	Vector2 result;
-	result.x = _a.x + _b.x;
-	result.y = _a.y + _b.y;
-
-	return result;
-}
 
-Vector2
-operator- (Vector2 const& _a, Vector2 const& _b)
-{
-	Vector2 result;
-	result.x = _a.x - _b.x;
-	result.y = _a.y - _b.y;
+		/* whether a slot newer than front() has been published */
+		bool
+		fresh ()
+		{
+			return ready.load(std::memory_order_acquire) & FRESH;
+		}
 
-	return result;
-}
+		void
+		acquire ()
+		{
+			reader = ready.exchange(reader, std::memory_order_acq_rel) & INDEX;
+		}
 
-Vector2&
-operator/= (Vector2& _v, float _s)
-{
-  _v.x /= _s;
-  _v.y /= _s;
+		T&
+		front ()
+		{
+			return slots[reader];
+		}
 
-  return _v;
-}
+	private:
+		static const unsigned int INDEX = 3;
+		static const unsigned int FRESH = 4;
 
-Vector2&
-operator+= (Vector2 & _a, Vector2 const& _b)
-{
-  _a.x += _b.x;
-  _a.y += _b.y;
+		T slots[3];
+		unsigned int writer;
+		unsigned int reader;
 
-  return _a;
-}
+		/* index of the published slot, FRESH until the reader takes it */
+		std::atomic<unsigned int> ready;
+};
 
-Vector2&
-operator-= (Vector2& _a, Vector2& _b)
+/* A completed state of the simulation, as handed to the renderer. */
+class Snapshot
 {
-  _a.x -= _b.x;
-  _a.y -= _b.y;
-
-  return _a;
-}
+	public:
+		std::vector<Mosquito> swarm;
+		Dragonfly dragonfly;
+		std::chrono::steady_clock::time_point time;
+};
 
 Vector2
-rule_1 (Mosquito& _m, std::vector<Mosquito> _swarm)
+lerp (Vector2 _a, Vector2 _b, float _alpha)
 {
-	Vector2 mass_centre;
-
-	for (auto& m : _swarm)
-	{
-		if (&_m != &m)
-			mass_centre += m.position;
-	}
-	mass_centre /= (_swarm.size() - 1);
-
-	Vector2 direction = mass_centre - _m.position;	
-	direction /= 50.0f;
-
-	return direction;
+	return Vector2(_a.x + (_b.x - _a.x) * _alpha, _a.y + (_b.y - _a.y) * _alpha);
 }
 
-Vector2
-rule_2 (Mosquito& _m, std::vector<Mosquito> _swarm)
+/* The state between two snapshots, _alpha 0 is _from and 1 is _to. */
+void
+interpolate (Snapshot& _from, Snapshot& _to, float _alpha, Snapshot& _out)
 {
-	Vector2 centre;
-
-	for(auto& m : _swarm)
+	_out.swarm.resize(_to.swarm.size());
+	for (unsigned int i = 0; i < _to.swarm.size(); i++)
 	{
-		if (&_m != &m)
-		{
-			Vector2 difference = m.position - _m.position;
-			if (difference.length() < 20.0f)
-				centre -= difference;
-		}
+		_out.swarm[i].position = lerp(_from.swarm[i].position,
+		    _to.swarm[i].position, _alpha);
+		_out.swarm[i].velocity = lerp(_from.swarm[i].velocity,
+		    _to.swarm[i].velocity, _alpha);
 	}
 
-	return centre;
+	_out.dragonfly.position = lerp(_from.dragonfly.position,
+	    _to.dragonfly.position, _alpha);
+	_out.dragonfly.velocity = lerp(_from.dragonfly.velocity,
+	    _to.dragonfly.velocity, _alpha);
 }
 
-Vector2
-rule_3 (Mosquito& _m, std::vector<Mosquito> _swarm)
+std::atomic<unsigned long long> simulated_steps(0);
+
+/* The simulation thread: step with a fixed timestep of 1/simulation_rate and
+ * publish every completed state. A late step is caught up once, a thread that
+ * cannot keep up at all simply runs as fast as it can. */
+void
+simulate (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly,
+    TripleBuffer<Snapshot>& _snapshots)
 {
-	Vector2 velocity;
+	std::chrono::steady_clock::duration period(0);
+	if (simulation_rate > 0.0)
+		period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		    std::chrono::duration<double>(1.0 / simulation_rate));
+
+	auto next = std::chrono::steady_clock::now();
 
-	for(auto& m : _swarm)
+	while (!done)
 	{
-		if (&_m != &m)
+		if (!is_active)
 		{
-			velocity += m.velocity;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			next = std::chrono::steady_clock::now();
+			continue;
 		}
-	}
-	velocity /= (float)(_swarm.size() - 1);
-
-	Vector2 result;
-	result = velocity - _m.velocity;
-	result /= 2.0f;
-
-	return result;
-}
 
-Vector2
-rule_4 (Mosquito& _m)
-{
-	Vector2 top_velocity;
-	Vector2 bottom_velocity;
-	Vector2 left_velocity;
-	Vector2 right_velocity;
-
-	if (_m.position.x == 0.0f || _m.position.y == 0.0f ||
-	    _m.position.x == 600.0f || _m.position.y == 600.0f)
-		return Vector2();
-
-	top_velocity.y = fabs(20.0f / _m.position.y);	
-	bottom_velocity.y = -fabs(20.0f / (_m.position.y - 600.0f));	
-	left_velocity.x = fabs(20.0f / _m.position.x);	
-	right_velocity.x = -fabs(20.0f / (_m.position.x - 600.0f));	
-
-	Vector2 result = top_velocity + bottom_velocity + left_velocity +
-	    right_velocity;
+		_swarm = step(_swarm, _dragonfly);
+		move_dragonfly(_dragonfly, _swarm);
 
-	result /= 0.1f;
+		Snapshot& snapshot = _snapshots.back();
+		snapshot.swarm = _swarm;
+		snapshot.dragonfly = _dragonfly;
+		snapshot.time = std::chrono::steady_clock::now();
+		_snapshots.publish();
+		simulated_steps++;
 
-	return result;
+		next += period;
+		if (next < snapshot.time - period)
+			next = snapshot.time;
+		std::this_thread::sleep_until(next);
+	}
 }
 
-Vector2
-rule_5 (Mosquito& _m, Dragonfly& _d)
+/* Simulation and render rates, printed once a second. */
+class Rates
 {
-	Vector2 result = _m.position - _d.position;
-	result /= 60.0;
+	public:
+		Rates ()
+		{
+			start = std::chrono::steady_clock::now();
+			frames = 0;
+			steps = simulated_steps;
+		}
 
-	return result;
-}
+		void
+		frame ()
+		{
+			frames++;
 
-Vector2
-hunt (Dragonfly& _d, std::vector<Mosquito>& _swarm)
-{
-	Vector2 closest = _d.position - _swarm[0].position;
+			auto now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - start).count();
+			if (seconds < 1.0)
+				return;
 
-	for (auto& m : _swarm)
-		if ((_d.position - m.position).length() < closest.length())
-			closest = (_d.position - m.position);
+			unsigned long long total = simulated_steps;
+			printf("simulation %.1f steps/s, render %.1f frames/s\n",
+			    (total - steps) / seconds, frames / seconds);
 
-	closest /= -35.0f;
+			start = now;
+			frames = 0;
+			steps = total;
+		}
 
-	return closest;
-}
+	private:
+		std::chrono::steady_clock::time_point start;
+		unsigned int frames;
+		unsigned long long steps;
+};
 
-std::vector<Mosquito>
-step (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
+/* Draw at display rate while the simulation thread steps at its own rate.
+ * The renderer shows the state between the two latest snapshots, so the
+ * motion stays smooth when the two rates differ, at the cost of one step of
+ * latency. */
+void
+main_loop (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
 {
-	std::vector<Mosquito> new_swarm;
-
-	for (auto& m : _swarm)
+	if (lockstep)
 	{
-		Vector2 v1 = rule_1(m, _swarm);
-		Vector2 v2 = rule_2(m, _swarm);
-		Vector2 v3 = rule_3(m, _swarm);
-		Vector2 v4 = rule_4(m);
-		Vector2 v5 = rule_5(m, _dragonfly);
-
-		Vector2 velocity;
-		velocity += v1;
-		velocity += v2;
-		velocity += v3;
-		velocity += v4;
-		velocity += v5;
-
-		velocity /= 10000.0f;
-
-		Mosquito new_mosquito;
-		new_mosquito.velocity = m.velocity + velocity;
-		new_mosquito.position = m.position + new_mosquito.velocity;
-
-		if (new_mosquito.velocity.length() > 0.6)
-			new_mosquito.velocity /= 10.0f;
-
-		new_swarm.push_back(new_mosquito);
+		lockstep_loop(_swarm, _dragonfly);
+		return;
 	}
 
-	return new_swarm;
-}
-
-void
-draw_scene (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
-{
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+	TripleBuffer<Snapshot> snapshots;
+	std::thread simulation(simulate, std::ref(_swarm), std::ref(_dragonfly),
+	    std::ref(snapshots));
 
-	for (auto& m : _swarm)
-		m.draw();
-
-	_dragonfly.draw();
-}
+	Snapshot previous;
+	Snapshot shown;
+	unsigned int received = 0;
+	Rates rates;
 
-void
-main_loop (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
-{
 	is_active = true;
 	SDL_Event event;
 
@@ -397,19 +351,41 @@ main_loop (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
 			}
 		}
 
-			
-		if (is_active)
+		if (!is_active)
+			continue;
+
+		/* the front slot goes back to the writer, keep it for interpolation */
+		if (snapshots.fresh())
 		{
-			_swarm = step(_swarm, _dragonfly);
-			_dragonfly.velocity += hunt(_dragonfly, _swarm);
-			if (_dragonfly.velocity.length() > 0.2)
-				_dragonfly.velocity /= 10.0f;
-			_dragonfly.position += _dragonfly.velocity;
+			if (received > 0)
+				previous = snapshots.front();
+			snapshots.acquire();
+			received++;
+		}
 
-			draw_scene(_swarm, _dragonfly);
-			SDL_GL_SwapBuffers();
+		if (received == 0)
+			continue;
+
+		Snapshot& latest = snapshots.front();
+		if (received == 1)
+			draw_scene(latest.swarm, latest.dragonfly);
+		else
+		{
+			double interval = std::chrono::duration<double>(latest.time
+			    - previous.time).count();
+			double elapsed = std::chrono::duration<double>(
+			    std::chrono::steady_clock::now() - latest.time).count();
+			float alpha = (interval > 0.0) ? std::min(elapsed / interval, 1.0) : 1.0f;
+
+			interpolate(previous, latest, alpha, shown);
+			draw_scene(shown.swarm, shown.dragonfly);
 		}
+
+		SDL_GL_SwapBuffers();
+		rates.frame();
 	}
+
+	simulation.join();
 }
 
 int 
@@ -418,17 +394,40 @@ main (int argc, char *argv[])
 	const unsigned int SWARM_SIZE = 15;
 
 	std::vector<Mosquito> swarm;
-	srand(time(NULL));
+	uint32_t seed = time(NULL);
+
+	/* --brute-force disables the grid, --validate checks it every step,
+	 * --sim-rate sets the steps per second of the simulation thread (0 for
+	 * as fast as possible), --lockstep steps and draws on one thread,
+	 * --seed sets the seed of the swarm */
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--brute-force") == 0)
+			brute_force = true;
+		else if (strcmp(argv[i], "--validate") == 0)
+			validate = true;
+		else if (strcmp(argv[i], "--sim-rate") == 0 && i + 1 < argc)
+			simulation_rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "--lockstep") == 0)
+			lockstep = true;
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 10);
+		else
+		{
+			printf("Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
 
 	for (unsigned int i = 0; i < SWARM_SIZE; i++)
-		swarm.push_back(Mosquito::random()); 
+		swarm.push_back(Mosquito::random(seed, i)); 
 
-	Dragonfly dragonfly = Dragonfly::random();
+	Dragonfly dragonfly = Dragonfly::random(seed, 0);
 
   init_sdl();
-	/* init_opengl(); */
+	init_opengl();
 
-	/* main_loop(swarm, dragonfly); */
+	main_loop(swarm, dragonfly);
 	
 	return EXIT_SUCCESS;	
 }
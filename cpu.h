@@ -0,0 +1,515 @@
+/* The model of cpu.cpp: its mosquitoes and dragonfly, the rules and the step.
+ * main.cpp steps it beside its own for --compare, inside the namespace cpu
+ * so that the names do not clash with its own. */
+#ifndef KOMARNO_CPU_H
+#define KOMARNO_CPU_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <OpenGL/gl.h>
+
+namespace cpu
+{
+
+bool brute_force = false;
+bool validate = false;
+
+/* Independent sequences of random numbers under the same seed. */
+const uint32_t RANDOM_MOSQUITOES = 0;
+const uint32_t RANDOM_DRAGONFLIES = 1;
+
+/* The Philox4x32-10 counter-based generator of Salmon et al.: four random
+ * words for each counter, under a key of the seed and the sequence. Agent i
+ * draws from counter i, so its values do not depend on which thread or
+ * device computes them, or in which order. main.cpp and gpu.cpp have the
+ * same function. */
+void
+philox (uint32_t _counter, uint32_t _seed, uint32_t _sequence, uint32_t _out[4])
+{
+	uint32_t c0 = _counter;
+	uint32_t c1 = 0;
+	uint32_t c2 = 0;
+	uint32_t c3 = 0;
+	uint32_t k0 = _seed;
+	uint32_t k1 = _sequence;
+
+	for (unsigned int round = 0; round < 10; round++)
+	{
+		uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+		uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+
+	_out[0] = c0;
+	_out[1] = c1;
+	_out[2] = c2;
+	_out[3] = c3;
+}
+
+/* An integer in [0, _range) from the high bits of _word * _range, cheaper than
+ * the remainder. */
+uint32_t
+random_below (uint32_t _word, uint32_t _range)
+{
+	return (uint32_t)(((uint64_t)_word * _range) >> 32);
+}
+
+/* A velocity component in [-0.5, 0.5) in steps of 0.001. */
+float
+random_velocity (uint32_t _word)
+{
+	return (float)((int)random_below(_word, 1000) - 500) * 0.001f;
+}
+
+class Vector2
+{
+	public:
+		Vector2 (float _x = 0.0f, float _y = 0.0f)
+		{
+			x = _x;
+			y = _y;
+		}
+
+		float
+		length ()
+		{
+			return sqrtf(x*x + y*y);
+		}
+
+		float x;
+		float y;	
+};
+
+class Mosquito
+{
+	public:
+		Vector2 velocity;
+		Vector2 position;
+
+		/* Mosquito _index of the swarm of _seed, in one of the two corner
+		 * squares of the window. */
+		static Mosquito
+		random (uint32_t _seed, uint32_t _index)
+		{
+			Mosquito m;
+			uint32_t words[4];
+			philox(_index, _seed, RANDOM_MOSQUITOES, words);
+
+			m.velocity.x = random_velocity(words[0]);
+			m.velocity.y = random_velocity(words[1]);
+
+			/* the lowest bit picks the square, the high bits the position */
+			float corner = (words[2] & 1) ? 300.0f : 0.0f;
+			m.position.x = (float)random_below(words[2], 300) + corner;
+			m.position.y = (float)random_below(words[3], 300) + corner;
+
+			return m;
+		}
+
+		void
+		draw ()
+		{
+			glLoadIdentity();
+			glColor3ub(0, 99, 0);
+
+			glTranslatef(position.x, position.y, 0.0f);
+			glRotatef(atan2(velocity.y, velocity.x) * 180.0f / M_PI + 90.0f, 0.0f, 0.0f, 1.0f);
+
+			glBegin(GL_QUADS);
+				glVertex2f(-2.0f, -6.0f);
+				glVertex2f( 2.0f, -6.0f);
+				glVertex2f( 2.0f,  6.0f);
+				glVertex2f(-2.0f,  6.0f);
+			glEnd();
+		}
+
+};
+
+class Dragonfly
+{
+	public:
+		Vector2 velocity;
+		Vector2 position;
+
+		static Dragonfly 
+		random (uint32_t _seed, uint32_t _index)
+		{
+			Dragonfly d;
+			uint32_t words[4];
+			philox(_index, _seed, RANDOM_DRAGONFLIES, words);
+
+			d.velocity.x = random_velocity(words[0]);
+			d.velocity.y = random_velocity(words[1]);
+			d.position.x = (float)random_below(words[2], 600);
+			d.position.y = (float)random_below(words[3], 600);
+
+			return d;
+		}
+
+		void
+		draw ()
+		{
+			glLoadIdentity();
+			glColor3ub(111, 0, 0);
+
+			glTranslatef(position.x, position.y, 0.0f);
+			glRotatef(atan2(velocity.y, velocity.x) * 180.0f / M_PI + 90.0f, 0.0f, 0.0f, 1.0f);
+
+			glBegin(GL_QUADS);
+				glVertex2f(-4.0f, -8.0f);
+				glVertex2f( 4.0f, -8.0f);
+				glVertex2f( 4.0f,  8.0f);
+				glVertex2f(-4.0f,  8.0f);
+			glEnd();
+		}
+};
+
+/* Uniform grid over the pond with cells of the personal space radius. Each
+ * step the swarm indices are counting-sorted by cell, so that rule 2 only has
+ * to visit the 3x3 cells around a mosquito. Positions outside the pond are
+ * clamped to the border cells, which keeps the neighbourhood search exact. */
+class Grid
+{
+	public:
+		Grid (float _cell_size = 20.0f, float _extent = 600.0f)
+		{
+			cell_size = _cell_size;
+			side = (unsigned int)ceilf(_extent / _cell_size);
+			cell_start.resize(side * side + 1);
+		}
+
+		unsigned int
+		coordinate (float _c)
+		{
+			float c = _c / cell_size;
+
+			/* negative values and NaNs go to the first cell */
+			if (!(c >= 0.0f))
+				return 0;
+
+			if (c >= (float)(side - 1))
+				return side - 1;
+
+			return (unsigned int)c;
+		}
+
+		unsigned int
+		cell (Vector2& _position)
+		{
+			return coordinate(_position.y) * side + coordinate(_position.x);
+		}
+
+		void
+		build (std::vector<Mosquito>& _swarm)
+		{
+			cell_of.resize(_swarm.size());
+			indices.resize(_swarm.size());
+			std::fill(cell_start.begin(), cell_start.end(), 0);
+
+			for (unsigned int i = 0; i < _swarm.size(); i++)
+			{
+				cell_of[i] = cell(_swarm[i].position);
+				cell_start[cell_of[i] + 1]++;
+			}
+
+			for (unsigned int c = 0; c < side * side; c++)
+				cell_start[c + 1] += cell_start[c];
+
+			cursor.assign(cell_start.begin(), cell_start.end() - 1);
+			for (unsigned int i = 0; i < _swarm.size(); i++)
+				indices[cursor[cell_of[i]]++] = i;
+		}
+
+		float cell_size;
+		unsigned int side;
+
+		/* indices of cell c are indices[cell_start[c] .. cell_start[c+1]) */
+		std::vector<unsigned int> cell_start;
+		std::vector<unsigned int> indices;
+
+	private:
+		std::vector<unsigned int> cell_of;
+		std::vector<unsigned int> cursor;
+};
+
+Grid grid;
+
+Vector2
+operator+ (Vector2 const& _a, Vector2 const& _b)
+{
+	Vector2 result;
+	result.x = _a.x + _b.x;
+	result.y = _a.y + _b.y;
+
+	return result;
+}
+
+Vector2
+operator- (Vector2 const& _a, Vector2 const& _b)
+{
+	Vector2 result;
+	result.x = _a.x - _b.x;
+	result.y = _a.y - _b.y;
+
+	return result;
+}
+
+Vector2&
+operator/= (Vector2& _v, float _s)
+{
+  _v.x /= _s;
+  _v.y /= _s;
+
+  return _v;
+}
+
+Vector2&
+operator+= (Vector2 & _a, Vector2 const& _b)
+{
+  _a.x += _b.x;
+  _a.y += _b.y;
+
+  return _a;
+}
+
+Vector2&
+operator-= (Vector2& _a, Vector2& _b)
+{
+  _a.x -= _b.x;
+  _a.y -= _b.y;
+
+  return _a;
+}
+
+Vector2
+rule_1 (Mosquito& _m, std::vector<Mosquito>& _swarm)
+{
+	Vector2 mass_centre;
+
+	for (auto& m : _swarm)
+	{
+		if (&_m != &m)
+			mass_centre += m.position;
+	}
+	mass_centre /= (_swarm.size() - 1);
+
+	Vector2 direction = mass_centre - _m.position;	
+	direction /= 50.0f;
+
+	return direction;
+}
+
+Vector2
+rule_2 (Mosquito& _m, std::vector<Mosquito>& _swarm)
+{
+	Vector2 centre;
+
+	for(auto& m : _swarm)
+	{
+		if (&_m != &m)
+		{
+			Vector2 difference = m.position - _m.position;
+			if (difference.length() < 20.0f)
+				centre -= difference;
+		}
+	}
+
+	return centre;
+}
+
+Vector2
+rule_2 (unsigned int _index, std::vector<Mosquito>& _swarm, Grid& _grid)
+{
+	Vector2 centre;
+	Mosquito& me = _swarm[_index];
+
+	unsigned int x = _grid.coordinate(me.position.x);
+	unsigned int y = _grid.coordinate(me.position.y);
+	unsigned int x_from = (x == 0) ? 0 : x - 1;
+	unsigned int x_to = std::min(x + 1, _grid.side - 1);
+	unsigned int y_from = (y == 0) ? 0 : y - 1;
+	unsigned int y_to = std::min(y + 1, _grid.side - 1);
+
+	for (unsigned int row = y_from; row <= y_to; row++)
+	{
+		/* the neighbouring cells of one row are adjacent in the sorted order */
+		unsigned int from = _grid.cell_start[row * _grid.side + x_from];
+		unsigned int to = _grid.cell_start[row * _grid.side + x_to + 1];
+
+		for (unsigned int k = from; k < to; k++)
+		{
+			unsigned int j = _grid.indices[k];
+			if (j == _index)
+				continue;
+
+			Vector2 difference = _swarm[j].position - me.position;
+			if (difference.length() < 20.0f)
+				centre -= difference;
+		}
+	}
+
+	return centre;
+}
+
+/* Compare the grid and the brute-force rule 2 for the whole swarm. The sets of
+ * neighbours are identical, only the order of summation differs, therefore
+ * the results have to agree up to a relative error of 1e-4. */
+bool
+validate_rule_2 (std::vector<Mosquito>& _swarm, Grid& _grid)
+{
+	float max_error = 0.0f;
+
+	for (unsigned int i = 0; i < _swarm.size(); i++)
+	{
+		Vector2 expected = rule_2(_swarm[i], _swarm);
+		Vector2 actual = rule_2(i, _swarm, _grid);
+		Vector2 error = expected - actual;
+
+		max_error = std::max(max_error, error.length() / (1.0f + expected.length()));
+	}
+
+	if (max_error > 1e-4f)
+	{
+		fprintf(stderr, "Grid validation failed: relative error %g\n", max_error);
+		return false;
+	}
+
+	return true;
+}
+
+Vector2
+rule_3 (Mosquito& _m, std::vector<Mosquito>& _swarm)
+{
+	Vector2 velocity;
+
+	for(auto& m : _swarm)
+	{
+		if (&_m != &m)
+		{
+			velocity += m.velocity;
+		}
+	}
+	velocity /= (float)(_swarm.size() - 1);
+
+	Vector2 result;
+	result = velocity - _m.velocity;
+	result /= 2.0f;
+
+	return result;
+}
+
+Vector2
+rule_4 (Mosquito& _m)
+{
+	Vector2 top_velocity;
+	Vector2 bottom_velocity;
+	Vector2 left_velocity;
+	Vector2 right_velocity;
+
+	if (_m.position.x == 0.0f || _m.position.y == 0.0f ||
+	    _m.position.x == 600.0f || _m.position.y == 600.0f)
+		return Vector2();
+
+	top_velocity.y = fabs(20.0f / _m.position.y);	
+	bottom_velocity.y = -fabs(20.0f / (_m.position.y - 600.0f));	
+	left_velocity.x = fabs(20.0f / _m.position.x);	
+	right_velocity.x = -fabs(20.0f / (_m.position.x - 600.0f));	
+
+	Vector2 result = top_velocity + bottom_velocity + left_velocity +
+	    right_velocity;
+
+	result /= 0.1f;
+
+	return result;
+}
+
+Vector2
+rule_5 (Mosquito& _m, Dragonfly& _d)
+{
+	Vector2 result = _m.position - _d.position;
+	result /= 60.0;
+
+	return result;
+}
+
+Vector2
+hunt (Dragonfly& _d, std::vector<Mosquito>& _swarm)
+{
+	Vector2 closest = _d.position - _swarm[0].position;
+
+	for (auto& m : _swarm)
+		if ((_d.position - m.position).length() < closest.length())
+			closest = (_d.position - m.position);
+
+	closest /= -35.0f;
+
+	return closest;
+}
+
+std::vector<Mosquito>
+step (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
+{
+	std::vector<Mosquito> new_swarm;
+
+	if (!brute_force || validate)
+		grid.build(_swarm);
+
+	if (validate && !validate_rule_2(_swarm, grid))
+		exit(1);
+
+	for (unsigned int i = 0; i < _swarm.size(); i++)
+	{
+		Mosquito& m = _swarm[i];
+
+		Vector2 v1 = rule_1(m, _swarm);
+		Vector2 v2 = brute_force ? rule_2(m, _swarm) : rule_2(i, _swarm, grid);
+		Vector2 v3 = rule_3(m, _swarm);
+		Vector2 v4 = rule_4(m);
+		Vector2 v5 = rule_5(m, _dragonfly);
+
+		Vector2 velocity;
+		velocity += v1;
+		velocity += v2;
+		velocity += v3;
+		velocity += v4;
+		velocity += v5;
+
+		velocity /= 10000.0f;
+
+		Mosquito new_mosquito;
+		new_mosquito.velocity = m.velocity + velocity;
+		new_mosquito.position = m.position + new_mosquito.velocity;
+
+		if (new_mosquito.velocity.length() > 0.6)
+			new_mosquito.velocity /= 10.0f;
+
+		new_swarm.push_back(new_mosquito);
+	}
+
+	return new_swarm;
+}
+
+/* Steer _dragonfly towards the nearest mosquito of _swarm and move it. */
+void
+move_dragonfly (Dragonfly& _dragonfly, std::vector<Mosquito>& _swarm)
+{
+	_dragonfly.velocity += hunt(_dragonfly, _swarm);
+	if (_dragonfly.velocity.length() > 0.2)
+		_dragonfly.velocity /= 10.0f;
+	_dragonfly.position += _dragonfly.velocity;
+}
+
+}
+
+#endif
@@ -0,0 +1,528 @@
+/* Selecting the OpenCL device and building source.cl for it, shared by
+ * main.cpp and gpu.cpp. The device comes from device_choice, "auto" times a
+ * short run on every device, and the program binaries are cached on disk. */
+#ifndef KOMARNO_DEVICE_H
+#define KOMARNO_DEVICE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <OpenCL/opencl.h>
+
+cl_context context;
+cl_int err;
+
+cl_device_id* devices;
+cl_device_id device;
+cl_uint num_devices;
+
+cl_platform_id* platforms;
+cl_platform_id platform;
+cl_uint num_platforms;
+
+/* "auto" or "platform:device" from --device or $KOMARNO_DEVICE, NULL
+ * to ask interactively */
+const char* device_choice = NULL;
+
+/* properties of the command queue init_cl() creates */
+cl_command_queue_properties queue_properties = 0;
+
+cl_command_queue command_queue;
+cl_program program;
+
+/* -D options of source.cl, part of the key of the cached binary */
+std::string build_options;
+
+bool
+platform_selection ()
+{
+	err = clGetPlatformIDs (0, NULL, &num_platforms);
+	if (num_platforms == 0)
+	{
+		printf("No platforms.\n");
+		return false;
+	}
+	platforms = new cl_platform_id[num_platforms];
+	err = clGetPlatformIDs (num_platforms, platforms, NULL);
+
+	int selected_platform;
+
+	/* the platform given as "platform:device" on the command line */
+	if (device_choice != NULL)
+		selected_platform = atoi(device_choice);
+	else
+	{
+		/* let the user to choose the platform */
+		printf("Select the platform: \n");
+		for (unsigned int i = 0; i < num_platforms; i++)
+		{
+			char name[1024];
+			err = clGetPlatformInfo (platforms[i], CL_PLATFORM_NAME, 1024, &name, NULL);
+			printf("%d) %s\n", i+1, name);
+		}
+
+		scanf("%d", &selected_platform);
+	}
+
+	/* check the selection for errors */
+	if (selected_platform < 1 || selected_platform > (int)num_platforms)
+	{
+		printf("Selection failed: not such platform number.\n");
+		return false;
+	}
+
+	platform = platforms[selected_platform-1];
+	return true;
+}
+
+bool
+device_selection ()
+{
+	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, 
+	    NULL, &num_devices);
+	if (num_devices == 0)
+	{
+		printf("No devices.\n");
+		return false;
+	}
+
+	devices = new cl_device_id[num_devices];
+	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 
+	    num_devices, devices, NULL);
+
+	int selected_device;
+
+	/* the device given as "platform:device" on the command line */
+	if (device_choice != NULL)
+	{
+		const char* separator = strchr(device_choice, ':');
+		selected_device = (separator != NULL) ? atoi(separator + 1) : 1;
+	}
+	else
+	{
+		/* let the user to choose the device */
+		printf("Select the device: \n");
+		for (unsigned int i = 0; i < num_devices; i++)
+		{
+			char name[1024];
+			err = clGetDeviceInfo (devices[i], CL_DEVICE_NAME, 1024, &name, NULL);
+			printf("%d) %s\n", i+1, name);
+		}
+
+		scanf("%d", &selected_device);
+	}
+
+	/* check the selection for errors */
+	if (selected_device < 1 || selected_device > (int)num_devices)
+	{
+		printf("Selection failed: not such device number.\n");
+		return false;
+	}
+
+	device = devices[selected_device-1];
+	return true;
+}
+
+/* Print the selected device, so that the run log records where it ran. */
+void
+log_device (const char* _how)
+{
+	char platform_name[1024];
+	char device_name[1024];
+	char driver[1024];
+
+	err = clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(platform_name),
+	    platform_name, NULL);
+	err = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name),
+	    device_name, NULL);
+	err = clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+
+	printf("device: %s / %s (driver %s, %s)\n", platform_name, device_name,
+	    driver, _how);
+}
+
+bool
+init_cl ()
+{
+	context = clCreateContext(0, 1, &device, NULL, NULL, &err);
+	command_queue = clCreateCommandQueue(context, device, queue_properties, &err);
+
+	return true;
+}
+
+/* FNV-1a hash of a block of memory, continuing from _hash. */
+uint64_t
+fnv1a (const void* _data, size_t _size, uint64_t _hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = (const unsigned char*)_data;
+
+	for (size_t i = 0; i < _size; i++)
+	{
+		_hash ^= bytes[i];
+		_hash *= 1099511628211ull;
+	}
+
+	return _hash;
+}
+
+/* Directory of the program binary cache: $KOMARNO_CACHE, or ~/.cache/komarno. */
+std::string
+cache_directory ()
+{
+	const char* directory = getenv("KOMARNO_CACHE");
+	if (directory != NULL)
+	{
+		mkdir(directory, 0755);
+		return directory;
+	}
+
+	const char* home = getenv("HOME");
+	std::string path = (home != NULL) ? home : ".";
+
+	path += "/.cache";
+	mkdir(path.c_str(), 0755);
+	path += "/komarno";
+	mkdir(path.c_str(), 0755);
+
+	return path;
+}
+
+/* The cached binary is keyed by the device, the driver version, the build
+ * options and the source code, so any change of these rebuilds it. */
+std::string
+cache_path (const char* _source, size_t _size)
+{
+	char name[1024];
+	char driver[1024];
+
+	err = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+	err = clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+
+	uint64_t key = fnv1a(name, strlen(name) + 1);
+	key = fnv1a(driver, strlen(driver) + 1, key);
+	key = fnv1a(build_options.c_str(), build_options.size() + 1, key);
+	key = fnv1a(_source, _size, key);
+
+	char file[32];
+	snprintf(file, sizeof(file), "/%016llx.bin", (unsigned long long)key);
+
+	return cache_directory() + file;
+}
+
+bool
+load_cached_program (std::string& _path)
+{
+	FILE* file = fopen(_path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+
+	std::vector<unsigned char> binary;
+	unsigned char buffer[65536];
+	size_t count;
+
+	while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		binary.insert(binary.end(), buffer, buffer + count);
+	fclose(file);
+
+	size_t size = binary.size();
+	const unsigned char* data = binary.data();
+	cl_int binary_status;
+
+	program = clCreateProgramWithBinary(context, 1, &device, &size, &data,
+	    &binary_status, &err);
+	if (err != CL_SUCCESS)
+		return false;
+
+	/* a binary the driver rejects is rebuilt from source, which replaces
+	 * program */
+	if (binary_status != CL_SUCCESS)
+	{
+		clReleaseProgram(program);
+		return false;
+	}
+
+	err = clBuildProgram(program, 1, &device, build_options.c_str(), NULL, NULL);
+	if (err != CL_SUCCESS)
+	{
+		clReleaseProgram(program);
+		return false;
+	}
+
+	return true;
+}
+
+void
+store_program (std::string& _path)
+{
+	size_t size;
+	err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t),
+	    &size, NULL);
+	if (err != CL_SUCCESS || size == 0)
+		return;
+
+	std::vector<unsigned char> binary(size);
+	unsigned char* data = binary.data();
+	err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*),
+	    &data, NULL);
+	if (err != CL_SUCCESS)
+		return;
+
+	/* write to a temporary file first, so that concurrent runs never see a
+	 * partially written binary */
+	std::string temporary = _path + "." + std::to_string(getpid());
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == NULL)
+		return;
+
+	bool written = fwrite(data, 1, size, file) == size;
+	if (fclose(file) == 0 && written)
+		rename(temporary.c_str(), _path.c_str());
+	else
+		unlink(temporary.c_str());
+}
+
+bool
+build_cl_program (const char* _filename)
+{
+	int fd = open(_filename, O_RDONLY);
+	struct stat stats;
+	fstat(fd, &stats);
+
+	errno = 0;
+	char* source = (char*)mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (errno != 0)
+	{
+		printf("ERROR: %s\n", strerror(errno));
+		return false;
+	}
+
+	std::string path = cache_path(source, stats.st_size);
+	if (load_cached_program(path))
+	{
+		printf("program loaded from %s\n", path.c_str());
+		munmap(source, stats.st_size);
+		close(fd);
+		return true;
+	}
+
+	/* build the code */
+	program = clCreateProgramWithSource(context, 1, (const char**)&source,
+	    (const size_t*)&stats.st_size, &err);
+	cl_int build_err = clBuildProgram(program, 1, &device, build_options.c_str(),
+	    NULL, NULL);
+
+	munmap(source, stats.st_size);
+	close(fd);
+
+	/* print the build log */
+	cl_build_status build_status;
+	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_STATUS, sizeof(cl_build_status), &build_status, NULL);
+
+	char *build_log;
+	size_t ret_val_size;
+	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
+
+	build_log = new char[ret_val_size+1];
+	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, ret_val_size, build_log, NULL);
+	build_log[ret_val_size] = '\0';
+	printf("build log: \n %s", build_log);
+	delete[] build_log;
+
+	if (build_err != CL_SUCCESS)
+		return false;
+
+	store_program(path);
+
+	return true;
+}
+
+/* Seconds per fused step of a random swarm of _size mosquitoes on the
+ * current device, or a negative value if the device cannot run it. The
+ * context, the program and the buffers are released afterwards. */
+double
+benchmark_device (unsigned int _size)
+{
+	double seconds = -1.0;
+
+	if (!init_cl() || !build_cl_program("source.cl"))
+		return seconds;
+
+	/* a swarm of seed 0 and, as the predator, the first mosquito of seed 1,
+	 * both drawn by the random_swarm kernel; mosquitoes and the predator are
+	 * {position, velocity} */
+	size_t bytes = sizeof(float) * 4 * _size;
+	cl_int errors[5];
+	cl_kernel kernel = clCreateKernel(program, "fused_step", &errors[0]);
+	cl_kernel random_kernel = clCreateKernel(program, "random_swarm", &errors[1]);
+	cl_mem current = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL,
+	    &errors[2]);
+	cl_mem next = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &errors[3]);
+	cl_mem hunter = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * 4,
+	    NULL, &errors[4]);
+
+	if (errors[0] == CL_SUCCESS && errors[1] == CL_SUCCESS
+	 && errors[2] == CL_SUCCESS && errors[3] == CL_SUCCESS
+	 && errors[4] == CL_SUCCESS)
+	{
+		size_t global_size = _size;
+		size_t single = 1;
+		unsigned int seeds[2] = {0, 1};
+		unsigned int one = 1;
+		const unsigned int warmup = 2;
+		const unsigned int runs = 10;
+
+		err  = clSetKernelArg(random_kernel, 0, sizeof(cl_mem), (void *) &current);
+		err |= clSetKernelArg(random_kernel, 1, sizeof(unsigned int), &seeds[0]);
+		err |= clSetKernelArg(random_kernel, 2, sizeof(unsigned int), &_size);
+		err |= clEnqueueNDRangeKernel(command_queue, random_kernel, 1, NULL,
+		    &global_size, NULL, 0, NULL, NULL);
+		err |= clSetKernelArg(random_kernel, 0, sizeof(cl_mem), (void *) &hunter);
+		err |= clSetKernelArg(random_kernel, 1, sizeof(unsigned int), &seeds[1]);
+		err |= clSetKernelArg(random_kernel, 2, sizeof(unsigned int), &one);
+		err |= clEnqueueNDRangeKernel(command_queue, random_kernel, 1, NULL,
+		    &single, NULL, 0, NULL, NULL);
+
+		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &hunter);
+		err |= clSetKernelArg(kernel, 3, sizeof(unsigned int), &_size);
+
+		std::chrono::steady_clock::time_point start;
+		for (unsigned int r = 0; r < warmup + runs && err == CL_SUCCESS; r++)
+		{
+			if (r == warmup)
+			{
+				clFinish(command_queue);
+				start = std::chrono::steady_clock::now();
+			}
+
+			err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) ((r % 2) ? &next : &current));
+			err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) ((r % 2) ? &current : &next));
+			err |= clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL,
+			    &global_size, NULL, 0, NULL, NULL);
+		}
+
+		if (err == CL_SUCCESS && clFinish(command_queue) == CL_SUCCESS)
+			seconds = std::chrono::duration<double>(
+			    std::chrono::steady_clock::now() - start).count() / runs;
+	}
+
+	if (errors[0] == CL_SUCCESS)
+		clReleaseKernel(kernel);
+	if (errors[1] == CL_SUCCESS)
+		clReleaseKernel(random_kernel);
+	if (errors[2] == CL_SUCCESS)
+		clReleaseMemObject(current);
+	if (errors[3] == CL_SUCCESS)
+		clReleaseMemObject(next);
+	if (errors[4] == CL_SUCCESS)
+		clReleaseMemObject(hunter);
+
+	clReleaseProgram(program);
+	clReleaseCommandQueue(command_queue);
+	clReleaseContext(context);
+
+	return seconds;
+}
+
+/* Time a short fused-step run on every device of every platform and select
+ * the fastest one for a swarm of _size mosquitoes. */
+bool
+auto_selection (unsigned int _size)
+{
+	err = clGetPlatformIDs (0, NULL, &num_platforms);
+	if (num_platforms == 0)
+	{
+		printf("No platforms.\n");
+		return false;
+	}
+	platforms = new cl_platform_id[num_platforms];
+	err = clGetPlatformIDs (num_platforms, platforms, NULL);
+
+	double best = -1.0;
+	cl_platform_id best_platform = NULL;
+	cl_device_id best_device = NULL;
+
+	for (unsigned int p = 0; p < num_platforms; p++)
+	{
+		cl_uint count = 0;
+		err = clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &count);
+		if (count == 0)
+			continue;
+
+		std::vector<cl_device_id> candidates(count);
+		err = clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, count,
+		    candidates.data(), NULL);
+
+		for (unsigned int d = 0; d < count; d++)
+		{
+			char name[1024];
+			err = clGetDeviceInfo(candidates[d], CL_DEVICE_NAME, sizeof(name),
+			    name, NULL);
+
+			platform = platforms[p];
+			device = candidates[d];
+			double seconds = benchmark_device(_size);
+
+			if (seconds < 0.0)
+			{
+				printf("auto: %u:%u %s failed\n", p + 1, d + 1, name);
+				continue;
+			}
+
+			printf("auto: %u:%u %s %.3f ms per step\n", p + 1, d + 1, name,
+			    seconds * 1e3);
+
+			if (best < 0.0 || seconds < best)
+			{
+				best = seconds;
+				best_platform = platforms[p];
+				best_device = candidates[d];
+			}
+		}
+	}
+
+	if (best < 0.0)
+	{
+		printf("No device could run the swarm.\n");
+		return false;
+	}
+
+	platform = best_platform;
+	device = best_device;
+
+	return true;
+}
+
+/* Select the device named by device_choice, "auto" for the fastest one, or
+ * ask for it without a choice. */
+bool
+choose_device (unsigned int _size)
+{
+	if (device_choice != NULL && strcmp(device_choice, "auto") == 0)
+	{
+		if (!auto_selection(_size))
+			return false;
+		log_device("selected by auto");
+	}
+	else
+	{
+		if (!platform_selection())
+			return false;
+
+		if (!device_selection())
+			return false;
+		log_device(device_choice != NULL ? device_choice : "selected interactively");
+	}
+
+	return true;
+}
+
+#endif
@@ -3,7 +3,10 @@
 #include <stdio.h>
 #include <cmath>
 #include <vector>
+#include <algorithm>
 #include <chrono>
+#include <thread>
+#include <atomic>
 #include <SDL/SDL.h>
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
@@ -12,10 +15,17 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string>
+#include <map>
 
-#define SWARM_SIZE 10
+#include "device.h"
 
-const unsigned int _SWARM_SIZE = SWARM_SIZE;
+/* number of mosquitoes, set by --size */
+unsigned int swarm_size = 10;
 
 typedef struct 
 {
@@ -34,27 +44,278 @@ typedef struct
 	vector2 position;
 	vector2 velocity;
 } object;
-object swarm[SWARM_SIZE];
+
+/* partial result of the nearest_prey kernel */
+typedef struct
+{
+	float distance;
+	unsigned int index;
+} candidate;
+
+/* factors of the five rules of one swarm of an ensemble, as in source.cl */
+typedef struct
+{
+	float rule_1;
+	float rule_2;
+	float rule_3;
+	float rule_4;
+	float rule_5;
+} weights;
+
+/* The constants of the rules, compiled into source.cl with -D options so that
+ * they fold into the kernels. Rule 1 divides the centre of mass itself by
+ * centre_scale, rule 2 keeps mosquitoes separation apart, rule 3 divides the
+ * difference to the mean velocity by alignment, rule 4 pushes with border
+ * over the distance to each border, divided by border_scale, and rule 5
+ * divides the way from the predator by fear. The sum of the rules is divided
+ * by inertia and capped at acceleration_limit. The predator steers towards
+ * its prey by its distance over chase and slows down by the factor slowdown
+ * when faster than predator_speed_limit. The world is world by world units.
+ * The defaults are those the kernels were written with.
+ *
+ * The kernels differ from the CPU step of main.cpp in rule 1 and in the
+ * limit, so those two constants have names of their own: main.cpp divides
+ * the way to the centre by cohesion, and slows a mosquito down once its speed
+ * reaches speed_limit. A file of --rules means the same in both programs and
+ * names only the constants that program knows. */
+class Rules
+{
+	public:
+		Rules ()
+		{
+			centre_scale = 1.0f;
+			separation = 20.0f;
+			alignment = 2.0f;
+			border = 20.0f;
+			border_scale = 0.1f;
+			fear = 60.0f;
+			inertia = 10000.0f;
+			acceleration_limit = 0.2f;
+			slowdown = 10.0f;
+			chase = 35.0f;
+			predator_speed_limit = 0.2f;
+			world = 600.0f;
+		}
+
+		/* Read "name value" lines from _path, # starts a comment. Rules that
+		 * are not named keep their value. */
+		bool
+		load (const char* _path)
+		{
+			FILE* file = fopen(_path, "r");
+			if (file == NULL)
+			{
+				printf("Unable to open %s: %s\n", _path, strerror(errno));
+				return false;
+			}
+
+			char line[256];
+			unsigned int number = 0;
+			bool valid = true;
+			while (valid && fgets(line, sizeof(line), file) != NULL)
+			{
+				number++;
+				line[strcspn(line, "#")] = '\0';
+
+				char name[64];
+				float value;
+				char rest;
+				int fields = sscanf(line, "%63s %f %c", name, &value, &rest);
+				if (fields <= 0)
+					continue;
+
+				float* rule = (fields == 2) ? find(name) : NULL;
+				if (rule == NULL || !(value > 0.0f))
+				{
+					printf("%s:%u: expected a rule and a positive value\n", _path,
+					    number);
+					valid = false;
+				}
+				else
+					*rule = value;
+			}
+			fclose(file);
+
+			return valid;
+		}
+
+		/* The -D options defining RULE_CENTRE_SCALE and so on for source.cl.
+		 * Nine digits give back every float exactly. */
+		std::string
+		options ()
+		{
+			std::string result;
+
+			for (auto& n : names())
+			{
+				char definition[64];
+				snprintf(definition, sizeof(definition), " -D RULE_%s=%#.9gf",
+				    n.macro, *n.value);
+				result += definition;
+			}
+
+			return result;
+		}
+
+		float centre_scale;
+		float separation;
+		float alignment;
+		float border;
+		float border_scale;
+		float fear;
+		float inertia;
+		float acceleration_limit;
+		float slowdown;
+		float chase;
+		float predator_speed_limit;
+		float world;
+
+	private:
+		struct Name
+		{
+			const char* name;
+			const char* macro;
+			float* value;
+		};
+
+		std::vector<Name>
+		names ()
+		{
+			return {
+				{"centre_scale", "CENTRE_SCALE", &centre_scale},
+				{"separation", "SEPARATION", &separation},
+				{"alignment", "ALIGNMENT", &alignment},
+				{"border", "BORDER", &border},
+				{"border_scale", "BORDER_SCALE", &border_scale},
+				{"fear", "FEAR", &fear},
+				{"inertia", "INERTIA", &inertia},
+				{"acceleration_limit", "ACCELERATION_LIMIT", &acceleration_limit},
+				{"slowdown", "SLOWDOWN", &slowdown},
+				{"chase", "CHASE", &chase},
+				{"predator_speed_limit", "PREDATOR_SPEED_LIMIT", &predator_speed_limit},
+				{"world", "WORLD", &world}
+			};
+		}
+
+		float*
+		find (const char* _name)
+		{
+			for (auto& n : names())
+				if (strcmp(n.name, _name) == 0)
+					return n.value;
+
+			return NULL;
+		}
+};
+
+/* --rules of the run, the defaults unless a file changes them */
+Rules rules;
+
+/* --seed of the run, the key of every random number */
+unsigned int random_seed = 0;
+
+/* Independent sequences of random numbers under the same seed, the
+ * random_swarm kernel draws from RANDOM_MOSQUITOES. */
+const uint32_t RANDOM_MOSQUITOES = 0;
+
+/* The Philox4x32-10 counter-based generator of Salmon et al., the same as
+ * philox() in source.cl: four random words for each counter, under a key of
+ * the seed and the sequence. */
+void
+philox (uint32_t _counter, uint32_t _seed, uint32_t _sequence, uint32_t _out[4])
+{
+	uint32_t c0 = _counter;
+	uint32_t c1 = 0;
+	uint32_t c2 = 0;
+	uint32_t c3 = 0;
+	uint32_t k0 = _seed;
+	uint32_t k1 = _sequence;
+
+	for (unsigned int round = 0; round < 10; round++)
+	{
+		uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+		uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+
+	_out[0] = c0;
+	_out[1] = c1;
+	_out[2] = c2;
+	_out[3] = c3;
+}
+
+/* An integer in [0, _range), mul_hi(_word, _range) on the device. */
+uint32_t
+random_below (uint32_t _word, uint32_t _range)
+{
+	return (uint32_t)(((uint64_t)_word * _range) >> 32);
+}
+
+/* A velocity component in [-0.5, 0.5) in steps of 0.001. */
+float
+random_velocity (uint32_t _word)
+{
+	return (float)((int)random_below(_word, 1000) - 500) * 0.001f;
+}
+
+/* The host copies of the swarm and the predator alternate between frames:
+ * one is rendered while the next state is read back into the other. The
+ * device owns the state, these are only for drawing. */
+std::vector<object> host_swarm[2];
+object* swarm;
+object host_predator[2];
 object predator;
 
 SDL_Surface *surface;
-bool done = false;
-bool is_active = true;
+std::atomic<bool> done(false);
+std::atomic<bool> is_active(true);
 
-cl_context context;
-cl_int err;
-size_t work_group_size[1];
+/* run the five rules and the step as separate kernels (for debugging) */
+bool split_kernels = false;
+
+/* overlap the computation of the next frame with rendering the current one */
+bool pipelined = true;
+
+/* measure and print how much of the frame time the overlap hides */
+bool report_overlap = false;
+
+/* time every command of the frames and print the breakdown at the end */
+bool profile = false;
+
+/* draw the swarm with one vertex array instead of a quad per mosquito */
+bool batched = true;
 
-cl_device_id* devices;
-cl_device_id device;
-cl_uint num_devices;
+/* simulation steps per rendered frame */
+unsigned int substeps = 1;
 
-cl_platform_id* platforms;
-cl_platform_id platform;
-cl_uint num_platforms;
+/* step and draw in turns on one thread instead of a simulation thread */
+bool lockstep = false;
+
+/* frames per second of the simulation thread, 0 runs it as fast as it can */
+double simulation_rate = 60.0;
+
+/* read the swarm through local memory tiles in the all-pairs kernels */
+bool tiled = false;
+
+/* number of independent swarms --ensemble steps together without rendering,
+ * 0 shows a single swarm */
+unsigned int ensemble_size = 0;
+
+/* requested work-group size, also the tile of the tiled kernels */
+size_t requested_local = 64;
+
+/* the NDRange of every kernel: the swarm padded to a multiple of the
+ * work-group size, the kernels skip the padding */
+size_t work_group_size[1];
+size_t local_size[1];
 
-cl_command_queue command_queue;
-cl_program program;
 cl_event event;
 
 cl_kernel rule_1_kernel;
@@ -63,6 +324,9 @@ cl_kernel rule_3_kernel;
 cl_kernel rule_4_kernel;
 cl_kernel rule_5_kernel;
 cl_kernel single_step_kernel;
+cl_kernel fused_step_kernel;
+cl_kernel nearest_prey_kernel;
+cl_kernel move_predator_kernel;
 
 cl_mem swarm_mem;
 cl_mem rule_1_mem;
@@ -72,13 +336,10 @@ cl_mem rule_4_mem;
 cl_mem rule_5_mem;
 cl_mem new_swarm_mem;
 cl_mem predator_mem;
+cl_mem nearest_mem;
 
-vector2 rule_1_array[SWARM_SIZE];
-vector2 rule_2_array[SWARM_SIZE];
-vector2 rule_3_array[SWARM_SIZE];
-vector2 rule_4_array[SWARM_SIZE];
-vector2 rule_5_array[SWARM_SIZE];
-object new_swarm[SWARM_SIZE];
+/* number of work-groups, each leaves one candidate in nearest_mem */
+unsigned int prey_groups;
 
 void
 init_sdl ()
@@ -115,7 +376,7 @@ resize_viewport ()
 {
   glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
-	glOrtho(0, 600, 600, 0, -1, 1);
+	glOrtho(0, rules.world, rules.world, 0, -1, 1);
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 	glDisable(GL_DEPTH_TEST);
@@ -134,302 +395,475 @@ init_opengl ()
 }
 
 bool
-platform_selection ()
+extract_kernels ()
 {
-	err = clGetPlatformIDs (0, NULL, &num_platforms);
-	if (num_platforms == 0)
+	rule_1_kernel = clCreateKernel(program, "rule_1", &err);
+	rule_2_kernel = clCreateKernel(program, "rule_2", &err);
+	rule_3_kernel = clCreateKernel(program, "rule_3", &err);
+	rule_4_kernel = clCreateKernel(program, "rule_4", &err);
+	rule_5_kernel = clCreateKernel(program, "rule_5", &err);
+	single_step_kernel = clCreateKernel(program, "single_step", &err);
+	fused_step_kernel = clCreateKernel(program, "fused_step", &err);
+	nearest_prey_kernel = clCreateKernel(program, "nearest_prey", &err);
+	move_predator_kernel = clCreateKernel(program, "move_predator", &err);
+
+	/* the all-pairs kernels are swapped for the tiled ones, they take the
+	 * same arguments plus the tile */
+	if (tiled)
 	{
-		printf("No platforms.\n");
-		return false;
+		clReleaseKernel(rule_1_kernel);
+		clReleaseKernel(rule_2_kernel);
+		clReleaseKernel(rule_3_kernel);
+		clReleaseKernel(fused_step_kernel);
+		rule_1_kernel = clCreateKernel(program, "rule_1_tiled", &err);
+		rule_2_kernel = clCreateKernel(program, "rule_2_tiled", &err);
+		rule_3_kernel = clCreateKernel(program, "rule_3_tiled", &err);
+		fused_step_kernel = clCreateKernel(program, "fused_step_tiled", &err);
 	}
-	platforms = new cl_platform_id[num_platforms];
-	err = clGetPlatformIDs (num_platforms, platforms, NULL);
 
-	/* let the user to choose the platform */
-	printf("Select the platform: \n");
-	for (unsigned int i = 0; i < num_platforms; i++)
+	/* one work-group size for all kernels, it has to fit each of them and
+	 * for the tiled ones also the local memory */
+	size_t local = requested_local;
+	cl_kernel kernels[] = {rule_1_kernel, rule_2_kernel, rule_3_kernel,
+	    rule_4_kernel, rule_5_kernel, single_step_kernel, fused_step_kernel,
+	    nearest_prey_kernel, move_predator_kernel};
+	for (unsigned int i = 0; i < 9; i++)
 	{
-		char name[1024];
-		err = clGetPlatformInfo (platforms[i], CL_PLATFORM_NAME, 1024, &name, NULL);
-		printf("%d) %s\n", i+1, name);
+		size_t limit;
+		err = clGetKernelWorkGroupInfo(kernels[i], device,
+		    CL_KERNEL_WORK_GROUP_SIZE, sizeof(limit), &limit, NULL);
+		if (err == CL_SUCCESS)
+			local = std::min(local, limit);
 	}
-	
-	int selected_platform;
-	scanf("%d", &selected_platform);
 
-	/* check the selection for errors */
-	if (selected_platform < 1 || selected_platform > num_platforms)
+	cl_ulong local_memory;
+	err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+	    sizeof(local_memory), &local_memory, NULL);
+	if (tiled && err == CL_SUCCESS)
+		local = std::min(local, (size_t)(local_memory / sizeof(object)));
+
+	if (local == 0)
 	{
-		printf("Selection failed: not such platform number.\n");
+		printf("No work-group size fits this device.\n");
 		return false;
 	}
 
-	platform = platforms[selected_platform-1];
+	local_size[0] = local;
+	work_group_size[0] = (swarm_size + local - 1) / local * local;
+
 	return true;
 }
 
 bool
-device_selection ()
+setup_memory ()
 {
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, 
-	    NULL, &num_devices);
-	if (num_devices == 0)
-	{
-		printf("No devices.\n");
-		return false;
-	}
+	/* the swarm lives on the device, the two buffers take turns as the
+	 * current and the next state; random_swarm() fills the first one */
+	cl_int errors[9];
+	std::fill(errors, errors + 9, CL_SUCCESS);
+	swarm_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+	    sizeof(object) * swarm_size, NULL, &errors[0]);
 
-	devices = new cl_device_id[num_devices];
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 
-	    num_devices, devices, NULL);
+	new_swarm_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+	    sizeof(object) * swarm_size, NULL, &errors[1]);
 
-	/* let the user to choose the device */
-	printf("Select the device: \n");
-	for (unsigned int i = 0; i < num_devices; i++)
-	{
-		char name[1024];
-		err = clGetDeviceInfo (devices[i], CL_DEVICE_NAME, 1024, &name, NULL);
-		printf("%d) %s\n", i+1, name);
-	}
+	predator_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
+	    sizeof(object), &predator, &errors[2]);
 
-	int selected_device;
-	scanf("%d", &selected_device);
+	prey_groups = work_group_size[0] / local_size[0];
+	nearest_mem = clCreateBuffer(context, CL_MEM_READ_WRITE,
+	    sizeof(candidate) * prey_groups, NULL, &errors[3]);
 
-	/* check the selection for errors */
-	if (selected_device < 1 || selected_device > num_devices)
+	/* the fused kernel keeps the rule contributions in registers */
+	if (split_kernels)
 	{
-		printf("Selection failed: not such device number.\n");
-		return false;
+		rule_1_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+		    sizeof(vector2) * swarm_size, NULL, &errors[4]);
+
+		rule_2_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+		    sizeof(vector2) * swarm_size, NULL, &errors[5]);
+
+		rule_3_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+		    sizeof(vector2) * swarm_size, NULL, &errors[6]);
+
+		rule_4_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+		    sizeof(vector2) * swarm_size, NULL, &errors[7]);
+
+		rule_5_mem = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+		    sizeof(vector2) * swarm_size, NULL, &errors[8]);
 	}
 
-	device = devices[selected_device-1];
+	for (auto e : errors)
+		if (e != CL_SUCCESS)
+		{
+			printf("Unable to allocate a swarm of %u mosquitoes: %d\n", swarm_size,
+			    e);
+
+			/* a failed allocation leaves its handle NULL */
+			cl_mem* buffers[] = {&swarm_mem, &new_swarm_mem, &predator_mem,
+			    &nearest_mem, &rule_1_mem, &rule_2_mem, &rule_3_mem, &rule_4_mem,
+			    &rule_5_mem};
+			for (auto b : buffers)
+			{
+				if (*b != NULL)
+					clReleaseMemObject(*b);
+				*b = NULL;
+			}
+
+			return false;
+		}
+
 	return true;
 }
 
+/* Point the kernels at the current swarm buffers. Called once at startup and
+ * after every swap of swarm_mem and new_swarm_mem. */
 bool
-init_cl ()
+bind_swarm_buffers ()
 {
-	context = clCreateContext(0, 1, devices, NULL, NULL, &err);
-	command_queue = clCreateCommandQueue(context, device, 0, &err);
+	err  = clSetKernelArg(fused_step_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+	err |= clSetKernelArg(fused_step_kernel, 2, sizeof(cl_mem), (void *) &new_swarm_mem);
 
-	return true;
+	/* the predator hunts in the new state, which is current after the swap */
+	err |= clSetKernelArg(nearest_prey_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+	err |= clSetKernelArg(move_predator_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+
+	if (split_kernels)
+	{
+		err |= clSetKernelArg(rule_1_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+		err |= clSetKernelArg(rule_2_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+		err |= clSetKernelArg(rule_3_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+		err |= clSetKernelArg(rule_4_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+		err |= clSetKernelArg(rule_5_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+		err |= clSetKernelArg(single_step_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
+		err |= clSetKernelArg(single_step_kernel, 6, sizeof(cl_mem), (void *) &new_swarm_mem);
+	}
+
+	return err == CL_SUCCESS;
 }
 
+/* Fill _buffer with _size mosquitoes of _seed on the device and read them
+ * back into _out, unless it is NULL. Every mosquito draws from its own
+ * counter, so the swarm is the same on any device. */
 bool
-build_cl_program (const char* _filename)
+random_swarm (cl_mem _buffer, unsigned int _size, unsigned int _seed,
+    object* _out)
 {
-	int fd = open(_filename, O_RDONLY);
-	struct stat stats;
-	fstat(fd, &stats);
-
-	errno = 0;
-	char* source = (char*)mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (errno != 0)
+	cl_kernel kernel = clCreateKernel(program, "random_swarm", &err);
+	if (err != CL_SUCCESS)
 	{
-		printf("ERROR: %s\n", strerror(errno));
+		printf("Unable to create the random_swarm kernel: %d\n", err);
 		return false;
 	}
 
-	/* build the code */
-	program = clCreateProgramWithSource(context, 1, (const char**)&source,
-	    (const size_t*)&stats.st_size, &err);
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-
-	/* print the build log */
-	cl_build_status build_status;
-	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_STATUS, sizeof(cl_build_status), &build_status, NULL);
+	err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &_buffer);
+	err |= clSetKernelArg(kernel, 1, sizeof(unsigned int), &_seed);
+	err |= clSetKernelArg(kernel, 2, sizeof(unsigned int), &_size);
 
-	char *build_log;
-	size_t ret_val_size;
-	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
+	size_t global_size = _size;
+	if (err == CL_SUCCESS)
+		err = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL,
+		    &global_size, NULL, 0, NULL, NULL);
+	if (err == CL_SUCCESS && _out != NULL)
+		err = clEnqueueReadBuffer(command_queue, _buffer, CL_TRUE, 0,
+		    sizeof(object) * _size, _out, 0, NULL, NULL);
+	clReleaseKernel(kernel);
 
-	build_log = new char[ret_val_size+1];
-	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, ret_val_size, build_log, NULL);
-	build_log[ret_val_size] = '\0';
-	printf("build log: \n %s", build_log);
+	if (err != CL_SUCCESS)
+	{
+		printf("Unable to initialise the swarm: %d\n", err);
+		return false;
+	}
 
 	return true;
 }
 
 bool
-extract_kernels ()
+setup_kernel_arguments ()
 {
-	rule_1_kernel = clCreateKernel(program, "rule_1", &err);
-	rule_2_kernel = clCreateKernel(program, "rule_2", &err);
-	rule_3_kernel = clCreateKernel(program, "rule_3", &err);
-	rule_4_kernel = clCreateKernel(program, "rule_4", &err);
-	rule_5_kernel = clCreateKernel(program, "rule_5", &err);
-	single_step_kernel = clCreateKernel(program, "single_step", &err);
+	if (!bind_swarm_buffers())
+	{
+		printf("Unable to set the kernel arguments: %d\n", err);
+		return false;
+	}
 
-	return true;
-}
+	err  = clSetKernelArg(fused_step_kernel, 1, sizeof(cl_mem), (void *) &predator_mem);
+	err |= clSetKernelArg(fused_step_kernel, 3, sizeof(unsigned int), &swarm_size);
 
-bool
-setup_memory ()
-{
-	swarm_mem = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(object) * SWARM_SIZE, swarm, &err);
+	/* the local memory for one tile of the swarm */
+	size_t tile_bytes = sizeof(object) * local_size[0];
+	if (tiled)
+		err |= clSetKernelArg(fused_step_kernel, 4, tile_bytes, NULL);
 
-	new_swarm_mem = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(object) * SWARM_SIZE, new_swarm, &err);
+	size_t scratch_bytes = sizeof(candidate) * local_size[0];
+	err |= clSetKernelArg(nearest_prey_kernel, 1, sizeof(cl_mem), (void *) &predator_mem);
+	err |= clSetKernelArg(nearest_prey_kernel, 2, sizeof(cl_mem), (void *) &nearest_mem);
+	err |= clSetKernelArg(nearest_prey_kernel, 3, sizeof(unsigned int), &swarm_size);
+	err |= clSetKernelArg(nearest_prey_kernel, 4, scratch_bytes, NULL);
 
-	rule_1_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(vector2) * SWARM_SIZE, rule_1_array, &err);
+	err |= clSetKernelArg(move_predator_kernel, 1, sizeof(cl_mem), (void *) &predator_mem);
+	err |= clSetKernelArg(move_predator_kernel, 2, sizeof(cl_mem), (void *) &nearest_mem);
+	err |= clSetKernelArg(move_predator_kernel, 3, sizeof(unsigned int), &prey_groups);
+	err |= clSetKernelArg(move_predator_kernel, 4, scratch_bytes, NULL);
 
-	rule_2_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(vector2) * SWARM_SIZE, rule_2_array, &err);
+	if (split_kernels)
+	{
+		if (tiled)
+		{
+			err |= clSetKernelArg(rule_1_kernel, 3, tile_bytes, NULL);
+			err |= clSetKernelArg(rule_2_kernel, 3, tile_bytes, NULL);
+			err |= clSetKernelArg(rule_3_kernel, 3, tile_bytes, NULL);
+		}
 
-	rule_3_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(vector2) * SWARM_SIZE, rule_3_array, &err);
+		err |= clSetKernelArg(rule_1_kernel, 1, sizeof(cl_mem), (void *) &rule_1_mem);
+		err |= clSetKernelArg(rule_1_kernel, 2, sizeof(unsigned int), &swarm_size);
 
-	rule_4_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(vector2) * SWARM_SIZE, rule_4_array, &err);
+		err |= clSetKernelArg(rule_2_kernel, 1, sizeof(cl_mem), (void *) &rule_2_mem);
+		err |= clSetKernelArg(rule_2_kernel, 2, sizeof(unsigned int), &swarm_size);
 
-	rule_5_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(vector2) * SWARM_SIZE, rule_5_array, &err);
+		err |= clSetKernelArg(rule_3_kernel, 1, sizeof(cl_mem), (void *) &rule_3_mem);
+		err |= clSetKernelArg(rule_3_kernel, 2, sizeof(unsigned int), &swarm_size);
 
-	predator_mem = clCreateBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, 
-	    sizeof(object), &predator, &err);
+		err |= clSetKernelArg(rule_4_kernel, 1, sizeof(cl_mem), (void *) &rule_4_mem);
+		err |= clSetKernelArg(rule_4_kernel, 2, sizeof(unsigned int), &swarm_size);
+
+		err |= clSetKernelArg(rule_5_kernel, 1, sizeof(cl_mem), (void *) &rule_5_mem);
+		err |= clSetKernelArg(rule_5_kernel, 2, sizeof(cl_mem), (void *) &predator_mem);
+		err |= clSetKernelArg(rule_5_kernel, 3, sizeof(unsigned int), &swarm_size);
+
+		err |= clSetKernelArg(single_step_kernel, 1, sizeof(cl_mem), (void *) &rule_1_mem);
+		err |= clSetKernelArg(single_step_kernel, 2, sizeof(cl_mem), (void *) &rule_2_mem);
+		err |= clSetKernelArg(single_step_kernel, 3, sizeof(cl_mem), (void *) &rule_3_mem);
+		err |= clSetKernelArg(single_step_kernel, 4, sizeof(cl_mem), (void *) &rule_4_mem);
+		err |= clSetKernelArg(single_step_kernel, 5, sizeof(cl_mem), (void *) &rule_5_mem);
+		err |= clSetKernelArg(single_step_kernel, 7, sizeof(unsigned int), &swarm_size);
+	}
+
+	if (err != CL_SUCCESS)
+	{
+		printf("Unable to set the kernel arguments: %d\n", err);
+		return false;
+	}
 
 	return true;
 }
 
-bool
-setup_kernel_arguments ()
+/* Timings of the commands of the frames for --profile. A command is labelled
+ * when it is enqueued and its queued, submit, start and end timestamps are
+ * read once its frame has finished. All launches of a kernel, or all reads of
+ * a buffer, make one row of the report: the minimum, median and 99th
+ * percentile of the execution time, the median time from enqueueing to
+ * submission and from submission to start, and the rate of the median
+ * command, in bytes for transfers and in pairs of mosquitoes for the all-pairs
+ * kernels. */
+class Profiler
 {
-	err = clSetKernelArg(rule_1_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
-	err = clSetKernelArg(rule_1_kernel, 1, sizeof(cl_mem), (void *) &rule_1_mem);
-	err = clSetKernelArg(rule_1_kernel, 2, sizeof(unsigned int), &_SWARM_SIZE);
+	public:
+		/* _event is a launch of _kernel */
+		void
+		kernel (cl_event _event, cl_kernel _kernel)
+		{
+			char name[64];
+			if (clGetKernelInfo(_kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name),
+			    name, NULL) != CL_SUCCESS)
+				strcpy(name, "kernel");
+
+			/* these visit every mosquito from every other one */
+			const char* all_pairs[] = {"rule_1", "rule_2", "rule_3",
+			    "rule_1_tiled", "rule_2_tiled", "rule_3_tiled", "fused_step",
+			    "fused_step_tiled"};
+			uint64_t pairs = 0;
+			for (auto n : all_pairs)
+				if (strcmp(name, n) == 0)
+					pairs = (uint64_t)swarm_size * (swarm_size - 1);
+
+			pending[_event] = command(name, 0, pairs);
+		}
 
-	err = clSetKernelArg(rule_2_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
-	err = clSetKernelArg(rule_2_kernel, 1, sizeof(cl_mem), (void *) &rule_2_mem);
-	err = clSetKernelArg(rule_2_kernel, 2, sizeof(unsigned int), &_SWARM_SIZE);
+		/* _event is a transfer of _bytes */
+		void
+		transfer (cl_event _event, const char* _name, size_t _bytes)
+		{
+			pending[_event] = command(_name, _bytes, 0);
+		}
 
-	err = clSetKernelArg(rule_3_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
-	err = clSetKernelArg(rule_3_kernel, 1, sizeof(cl_mem), (void *) &rule_3_mem);
-	err = clSetKernelArg(rule_3_kernel, 2, sizeof(unsigned int), &_SWARM_SIZE);
+		/* Read the timestamps of the labelled commands of a finished frame. */
+		void
+		collect (std::vector<cl_event>& _events)
+		{
+			const cl_profiling_info info[4] = {CL_PROFILING_COMMAND_QUEUED,
+			    CL_PROFILING_COMMAND_SUBMIT, CL_PROFILING_COMMAND_START,
+			    CL_PROFILING_COMMAND_END};
 
-	err = clSetKernelArg(rule_4_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
-	err = clSetKernelArg(rule_4_kernel, 1, sizeof(cl_mem), (void *) &rule_4_mem);
-	err = clSetKernelArg(rule_4_kernel, 2, sizeof(unsigned int), &_SWARM_SIZE);
+			for (auto& e : _events)
+			{
+				auto labelled = pending.find(e);
+				if (labelled == pending.end())
+					continue;
+
+				cl_ulong times[4];
+				bool valid = true;
+				for (unsigned int t = 0; t < 4; t++)
+					valid = valid && clGetEventProfilingInfo(e, info[t],
+					    sizeof(cl_ulong), &times[t], NULL) == CL_SUCCESS;
+
+				if (valid)
+				{
+					Command& c = commands[labelled->second];
+					c.submit.push_back((int64_t)(times[1] - times[0]) * 1e-9);
+					c.start.push_back((int64_t)(times[2] - times[1]) * 1e-9);
+					c.execution.push_back((int64_t)(times[3] - times[2]) * 1e-9);
+				}
+				pending.erase(labelled);
+			}
+		}
 
-	err = clSetKernelArg(rule_5_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
-	err = clSetKernelArg(rule_5_kernel, 1, sizeof(cl_mem), (void *) &rule_5_mem);
-	err = clSetKernelArg(rule_5_kernel, 2, sizeof(cl_mem), (void *) &predator_mem);
-	err = clSetKernelArg(rule_5_kernel, 3, sizeof(unsigned int), &_SWARM_SIZE);
+		void
+		print ()
+		{
+			printf("%-18s %7s %9s %9s %9s %9s %9s  %s\n", "command", "count",
+			    "min ms", "median ms", "p99 ms", "submit ms", "start ms", "rate");
 
-	err = clSetKernelArg(single_step_kernel, 0, sizeof(cl_mem), (void *) &swarm_mem);
-	err = clSetKernelArg(single_step_kernel, 1, sizeof(cl_mem), (void *) &rule_1_mem);
-	err = clSetKernelArg(single_step_kernel, 2, sizeof(cl_mem), (void *) &rule_2_mem);
-	err = clSetKernelArg(single_step_kernel, 3, sizeof(cl_mem), (void *) &rule_3_mem);
-	err = clSetKernelArg(single_step_kernel, 4, sizeof(cl_mem), (void *) &rule_4_mem);
-	err = clSetKernelArg(single_step_kernel, 5, sizeof(cl_mem), (void *) &rule_5_mem);
-	err = clSetKernelArg(single_step_kernel, 6, sizeof(cl_mem), (void *) &new_swarm_mem);
+			for (auto& c : commands)
+			{
+				if (c.execution.empty())
+					continue;
+
+				double median = percentile(c.execution, 0.5);
+				printf("%-18s %7zu %9.3f %9.3f %9.3f %9.3f %9.3f  ",
+				    c.name.c_str(), c.execution.size(),
+				    percentile(c.execution, 0.0) * 1e3, median * 1e3,
+				    percentile(c.execution, 0.99) * 1e3,
+				    percentile(c.submit, 0.5) * 1e3,
+				    percentile(c.start, 0.5) * 1e3);
+
+				if (median > 0.0 && c.bytes > 0)
+					printf("%.2f GB/s", c.bytes / median * 1e-9);
+				else if (median > 0.0 && c.pairs > 0)
+					printf("%.3g pairs/s", c.pairs / median);
+				printf("\n");
+			}
+		}
 
-	return true;
-}
+	private:
+		class Command
+		{
+			public:
+				std::string name;
+				uint64_t bytes;
+				uint64_t pairs;
+				std::vector<double> submit;
+				std::vector<double> start;
+				std::vector<double> execution;
+		};
+
+		/* index of the command called _name, added on its first use */
+		unsigned int
+		command (const char* _name, uint64_t _bytes, uint64_t _pairs)
+		{
+			for (unsigned int i = 0; i < commands.size(); i++)
+				if (commands[i].name == _name)
+					return i;
 
-void
-gpu_rule_1 ()
-{
-	err = clEnqueueWriteBuffer(command_queue, swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+			commands.push_back(Command());
+			commands.back().name = _name;
+			commands.back().bytes = _bytes;
+			commands.back().pairs = _pairs;
 
-	err = clEnqueueNDRangeKernel(command_queue, rule_1_kernel, 1, NULL, 
-	    work_group_size, NULL, 0, NULL, &event);
-	clReleaseEvent(event);
+			return commands.size() - 1;
+		}
 
-	err = clEnqueueReadBuffer(command_queue, rule_1_mem, CL_TRUE, 0, 
-	    sizeof(vector2) * SWARM_SIZE, &rule_1_array, 0, NULL, &event);
-	clReleaseEvent(event);
-}
+		/* the value below which _fraction of _values lie, by nearest rank */
+		static double
+		percentile (std::vector<double> _values, double _fraction)
+		{
+			size_t rank = (size_t)ceil(_fraction * _values.size());
+			size_t index = rank > 0 ? rank - 1 : 0;
+			std::nth_element(_values.begin(), _values.begin() + index,
+			    _values.end());
 
-void
-gpu_rule_2 ()
-{
-	err = clEnqueueWriteBuffer(command_queue, swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+			return _values[index];
+		}
 
-	err = clEnqueueNDRangeKernel(command_queue, rule_2_kernel, 1, NULL, 
-	    work_group_size, NULL, 0, NULL, &event);
-	clReleaseEvent(event);
+		std::vector<Command> commands;
+		std::map<cl_event, unsigned int> pending;
+};
 
-	err = clEnqueueReadBuffer(command_queue, rule_2_mem, CL_TRUE, 0, 
-	    sizeof(vector2) * SWARM_SIZE, &rule_2_array, 0, NULL, &event);
-	clReleaseEvent(event);
-}
+Profiler profiler;
 
 void
-gpu_rule_3 ()
+gpu_rule (cl_kernel _kernel, std::vector<cl_event>& _events,
+    size_t* _global_size = work_group_size)
 {
-	err = clEnqueueWriteBuffer(command_queue, swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+	err = clEnqueueNDRangeKernel(command_queue, _kernel, 1, NULL, 
+	    _global_size, local_size, _events.empty() ? 0 : 1,
+	    _events.empty() ? NULL : &_events.back(), &event);
+	_events.push_back(event);
 
-	err = clEnqueueNDRangeKernel(command_queue, rule_3_kernel, 1, NULL, 
-	    work_group_size, NULL, 0, NULL, &event);
-	clReleaseEvent(event);
-
-	err = clEnqueueReadBuffer(command_queue, rule_3_mem, CL_TRUE, 0, 
-	    sizeof(vector2) * SWARM_SIZE, &rule_3_array, 0, NULL, &event);
-	clReleaseEvent(event);
+	if (profile)
+		profiler.kernel(event, _kernel);
 }
 
-void
-gpu_rule_4 ()
+/* The new state is in new_swarm_mem, make it the current one. */
+bool
+swap_swarm_buffers ()
 {
-	err = clEnqueueWriteBuffer(command_queue, swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+	cl_mem tmp = swarm_mem;
+	swarm_mem = new_swarm_mem;
+	new_swarm_mem = tmp;
 
-	err = clEnqueueNDRangeKernel(command_queue, rule_4_kernel, 1, NULL, 
-	    work_group_size, NULL, 0, NULL, &event);
-	clReleaseEvent(event);
-
-	err = clEnqueueReadBuffer(command_queue, rule_4_mem, CL_TRUE, 0, 
-	    sizeof(vector2) * SWARM_SIZE, &rule_4_array, 0, NULL, &event);
-	clReleaseEvent(event);
+	return bind_swarm_buffers();
 }
 
+/* Write the four corners of a quad of the given half extents, centred at the
+ * position and heading along the velocity. The rotation by the heading plus
+ * 90 degrees has the cosine -dy and the sine dx of the unit velocity. */
 void
-gpu_rule_5 ()
+quad_vertices (float* _out, object& _o, float _half_width, float _half_length)
 {
-	err = clEnqueueWriteBuffer(command_queue, swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+	float length = _o.velocity.length();
+	float dx = 1.0f;
+	float dy = 0.0f;
 
-	err = clEnqueueWriteBuffer(command_queue, predator_mem, CL_TRUE, 0, 
-	    sizeof(object), &predator, 0, NULL, &event);
-	clReleaseEvent(event);
+	if (length > 0.0f)
+	{
+		dx = _o.velocity.x / length;
+		dy = _o.velocity.y / length;
+	}
 
-	err = clEnqueueNDRangeKernel(command_queue, rule_5_kernel, 1, NULL, 
-	    work_group_size, NULL, 0, NULL, &event);
-	clReleaseEvent(event);
+	const float corners[4][2] = {
+		{-_half_width, -_half_length},
+		{ _half_width, -_half_length},
+		{ _half_width,  _half_length},
+		{-_half_width,  _half_length}};
 
-	err = clEnqueueReadBuffer(command_queue, rule_5_mem, CL_TRUE, 0, 
-	    sizeof(vector2) * SWARM_SIZE, &rule_5_array, 0, NULL, &event);
-	clReleaseEvent(event);
+	for (unsigned int c = 0; c < 4; c++)
+	{
+		_out[2 * c] = _o.position.x - corners[c][0] * dy - corners[c][1] * dx;
+		_out[2 * c + 1] = _o.position.y + corners[c][0] * dx - corners[c][1] * dy;
+	}
 }
 
+std::vector<float> vertices;
+
+/* Draw the whole swarm with a single glDrawArrays call from one client-side
+ * vertex array. Needs only OpenGL 1.1, so it also works on Mesa's software
+ * rasteriser. */
 void
-gpu_simple_step ()
+draw_swarm_batched ()
 {
-	err = clEnqueueWriteBuffer(command_queue, swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+	vertices.resize(8 * swarm_size);
 
-	err = clEnqueueNDRangeKernel(command_queue, single_step_kernel, 1, NULL, 
-	    work_group_size, NULL, 0, NULL, &event);
-	clReleaseEvent(event);
+	for (unsigned int i = 0; i < swarm_size; i++)
+		quad_vertices(&vertices[8 * i], swarm[i], 2.0f, 6.0f);
 
-	err = clEnqueueReadBuffer(command_queue, new_swarm_mem, CL_TRUE, 0, 
-	    sizeof(object) * SWARM_SIZE, &new_swarm, 0, NULL, &event);
-	clReleaseEvent(event);
+	glLoadIdentity();
+	glColor3ub(0, 99, 0);
 
-	for (unsigned int i = 0; i < SWARM_SIZE; i++)
-		swarm[i] = new_swarm[i];	
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, vertices.data());
+	glDrawArrays(GL_QUADS, 0, 4 * swarm_size);
+	glDisableClientState(GL_VERTEX_ARRAY);
 }
 
 void
@@ -438,21 +872,26 @@ draw_scene ()
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 
-	for (unsigned int i = 0; i < SWARM_SIZE; i++)
+	if (batched)
+		draw_swarm_batched();
+	else
 	{
-		glLoadIdentity();
-		glColor3ub(0, 99, 0);
-
-		glTranslatef(swarm[i].position.x, swarm[i].position.y, 0.0f);
-		glRotatef(atan2(swarm[i].velocity.y, swarm[i].velocity.x) * 180.0f / M_PI 
-		    + 90.0f, 0.0f, 0.0f, 1.0f);
-
-		glBegin(GL_QUADS);
-			glVertex2f(-2.0f, -6.0f);
-			glVertex2f( 2.0f, -6.0f);
-			glVertex2f( 2.0f,  6.0f);
-			glVertex2f(-2.0f,  6.0f);
-		glEnd();
+		for (unsigned int i = 0; i < swarm_size; i++)
+		{
+			glLoadIdentity();
+			glColor3ub(0, 99, 0);
+
+			glTranslatef(swarm[i].position.x, swarm[i].position.y, 0.0f);
+			glRotatef(atan2(swarm[i].velocity.y, swarm[i].velocity.x) * 180.0f / M_PI 
+			    + 90.0f, 0.0f, 0.0f, 1.0f);
+
+			glBegin(GL_QUADS);
+				glVertex2f(-2.0f, -6.0f);
+				glVertex2f( 2.0f, -6.0f);
+				glVertex2f( 2.0f,  6.0f);
+				glVertex2f(-2.0f,  6.0f);
+			glEnd();
+		}
 	}
 
 	glLoadIdentity();
@@ -470,66 +909,409 @@ draw_scene ()
 	glEnd();
 }
 
-vector2
-operator- (vector2 const& _a, vector2 const& _b)
+/* Commands of the frames in flight, one list per host copy of the swarm. */
+std::vector<cl_event> frame_events[2];
+
+/* Enqueue the steps of one frame and the read of the result into _swarm and
+ * _predator without waiting. Each command depends on the previous one through
+ * its event in _events. The swarm and the predator stay on the device between
+ * the steps, only the rendered state is read. If the kernels cannot be pointed
+ * at the new state, the commands enqueued so far stay in _events, the
+ * simulation ends and false is returned. */
+bool
+step (std::vector<cl_event>& _events, object* _swarm, object* _predator)
+{
+	for (unsigned int s = 0; s < substeps; s++)
+	{
+		if (split_kernels)
+		{
+			gpu_rule(rule_1_kernel, _events);
+			gpu_rule(rule_2_kernel, _events);
+			gpu_rule(rule_3_kernel, _events);
+			gpu_rule(rule_4_kernel, _events);
+			gpu_rule(rule_5_kernel, _events);
+			gpu_rule(single_step_kernel, _events);
+		}
+		else
+			gpu_rule(fused_step_kernel, _events);
+
+		if (!swap_swarm_buffers())
+		{
+			printf("Unable to set the kernel arguments: %d\n", err);
+			done = true;
+			return false;
+		}
+
+		/* the predator hunts in the new state within one work-group */
+		gpu_rule(nearest_prey_kernel, _events);
+		gpu_rule(move_predator_kernel, _events, local_size);
+	}
+
+	err = clEnqueueReadBuffer(command_queue, swarm_mem, CL_FALSE, 0, 
+	    sizeof(object) * swarm_size, _swarm, 1, &_events.back(), &event);
+	_events.push_back(event);
+	if (profile)
+		profiler.transfer(event, "read swarm", sizeof(object) * swarm_size);
+
+	err = clEnqueueReadBuffer(command_queue, predator_mem, CL_FALSE, 0, 
+	    sizeof(object), _predator, 1, &_events.back(), &event);
+	_events.push_back(event);
+	if (profile)
+		profiler.transfer(event, "read predator", sizeof(object));
+
+	clFlush(command_queue);
+
+	return true;
+}
+
+/* Time the device spent on the commands of a finished frame. */
+double
+device_seconds (std::vector<cl_event>& _events)
 {
-	vector2 result;
-	result.x = _a.x - _b.x;
-	result.y = _a.y - _b.y;
+	double seconds = 0.0;
 
-	return result;
+	for (auto& e : _events)
+	{
+		cl_ulong start;
+		cl_ulong end;
+
+		clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(cl_ulong),
+		    &start, NULL);
+		clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(cl_ulong),
+		    &end, NULL);
+		seconds += (end - start) * 1e-9;
+	}
+
+	return seconds;
 }
 
-vector2&
-operator/= (vector2& _v, float _s)
+class OverlapStatistics
 {
-  _v.x /= _s;
-  _v.y /= _s;
+	public:
+		OverlapStatistics ()
+		{
+			reset();
+		}
+
+		void
+		reset ()
+		{
+			frames = 0;
+			frame = 0.0;
+			wait = 0.0;
+			device = 0.0;
+		}
+
+		/* Without the overlap, a frame would take the device time plus the
+		 * host time, which is the frame time minus the waiting. The overlap
+		 * therefore hides the device time minus the waiting. */
+		void
+		print ()
+		{
+			double hidden = std::max(device - wait, 0.0) / frames;
 
-  return _v;
+			printf("frame %.3f ms, device %.3f ms, waiting %.3f ms, "
+			    "overlap hides %.3f ms (%.0f%% of the serial frame time)\n",
+			    frame * 1e3 / frames, device * 1e3 / frames, wait * 1e3 / frames,
+			    hidden * 1e3, 100.0 * hidden / (frame / frames + hidden));
+		}
+
+		unsigned int frames;
+		double frame;
+		double wait;
+		double device;
+};
+
+OverlapStatistics overlap;
+
+void
+release_events (std::vector<cl_event>& _events)
+{
+	for (auto& e : _events)
+		clReleaseEvent(e);
+	_events.clear();
 }
 
-vector2&
-operator+= (vector2 & _a, vector2 const& _b)
+/* Wait until the frame in host_swarm[_slot] and host_predator[_slot] has
+ * arrived and make it the one drawn. */
+void
+wait_frame (unsigned int _slot)
 {
-  _a.x += _b.x;
-  _a.y += _b.y;
+	std::vector<cl_event>& events = frame_events[_slot];
 
-  return _a;
+	auto start = std::chrono::steady_clock::now();
+	clWaitForEvents(1, &events.back());
+	std::chrono::duration<double> waited = std::chrono::steady_clock::now()
+	    - start;
+
+	if (report_overlap)
+	{
+		overlap.wait += waited.count();
+		overlap.device += device_seconds(events);
+	}
+
+	if (profile)
+		profiler.collect(events);
+	release_events(events);
+
+	swarm = host_swarm[_slot].data();
+	predator = host_predator[_slot];
 }
 
-vector2
-hunt ()
+/* Step and draw in turns on one thread, the device computing the next frame
+ * while the current one is drawn. */
+void
+lockstep_loop ()
 {
-	vector2 closest = predator.position - swarm[0].position;
+	is_active = true;
+	SDL_Event event;
+
+	unsigned int slot = 0;
+	auto frame_start = std::chrono::steady_clock::now();
+
+	step(frame_events[slot], host_swarm[slot].data(), &host_predator[slot]);
 
-	for (unsigned int i = 0; i < SWARM_SIZE; i++)
+	while (!done)
 	{
-		if ((predator.position - swarm[i].position).length() < closest.length())
-			closest = (predator.position - swarm[i].position);
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+				case SDL_ACTIVEEVENT:
+					if (event.active.state == SDL_APPACTIVE )
+						is_active = (event.active.gain != 0);
+				break;
+
+				case SDL_QUIT:
+					done = true; 
+				break;
+
+				default:
+				break;
+			}
+		}
+
+			
+		if (is_active)
+		{
+			wait_frame(slot);
+
+			/* the device computes the next frame while this one is drawn */
+			slot = 1 - slot;
+			if (!step(frame_events[slot], host_swarm[slot].data(),
+			    &host_predator[slot]))
+				break;
+			if (!pipelined)
+				clFinish(command_queue);
+
+			draw_scene();
+			SDL_GL_SwapBuffers();
+
+			if (report_overlap)
+			{
+				auto now = std::chrono::steady_clock::now();
+				overlap.frame += std::chrono::duration<double>(now - frame_start).count();
+				frame_start = now;
+
+				if (++overlap.frames == 100)
+				{
+					overlap.print();
+					overlap.reset();
+				}
+			}
+		}
 	}
 
-	closest /= -35.0f;
+	wait_frame(slot);
+}
 
-	return closest;
+/* Lock-free triple buffer between one writer and one reader. The writer fills
+ * back() and publishes it, the reader takes the latest published slot with
+ * acquire() and keeps it in front() until it acquires again. Neither side
+ * ever waits for the other: the third slot holds the latest published state
+ * while the other two are in use. */
+template <typename T>
+class TripleBuffer
+{
+	public:
+		TripleBuffer ()
+		{
+			writer = 0;
+			ready = 1;
+			reader = 2;
+		}
+
+		T&
+		back ()
+		{
+			return slots[writer];
+		}
+
+		void
+		publish ()
+		{
+			writer = ready.exchange(writer | FRESH, std::memory_order_acq_rel)
+			    & INDEX;
+		}
+
+		/* whether a slot newer than front() has been published */
+		bool
+		fresh ()
+		{
+			return ready.load(std::memory_order_acquire) & FRESH;
+		}
+
+		void
+		acquire ()
+		{
+			reader = ready.exchange(reader, std::memory_order_acq_rel) & INDEX;
+		}
+
+		T&
+		front ()
+		{
+			return slots[reader];
+		}
+
+	private:
+		static const unsigned int INDEX = 3;
+		static const unsigned int FRESH = 4;
+
+		T slots[3];
+		unsigned int writer;
+		unsigned int reader;
+
+		/* index of the published slot, FRESH until the reader takes it */
+		std::atomic<unsigned int> ready;
+};
+
+/* A frame read back from the device, as handed to the renderer. */
+typedef struct
+{
+	std::vector<object> swarm;
+	object predator;
+	std::chrono::steady_clock::time_point time;
+} snapshot;
+
+object
+lerp (object& _a, object& _b, float _alpha)
+{
+	object result;
+	result.position.x = _a.position.x + (_b.position.x - _a.position.x) * _alpha;
+	result.position.y = _a.position.y + (_b.position.y - _a.position.y) * _alpha;
+	result.velocity.x = _a.velocity.x + (_b.velocity.x - _a.velocity.x) * _alpha;
+	result.velocity.y = _a.velocity.y + (_b.velocity.y - _a.velocity.y) * _alpha;
+
+	return result;
 }
 
+std::atomic<unsigned long long> simulated_steps(0);
+
+/* The simulation thread: compute a frame of substeps on the device every
+ * 1/simulation_rate seconds, read it straight into the back slot and publish
+ * it. A late frame is caught up once, a device that cannot keep up at all
+ * simply runs as fast as it can. */
 void
-step ()
+simulate (TripleBuffer<snapshot>& _snapshots)
 {
-	hunt();
+	std::vector<cl_event> events;
+	std::chrono::steady_clock::duration period(0);
+	if (simulation_rate > 0.0)
+		period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		    std::chrono::duration<double>(1.0 / simulation_rate));
 
-	gpu_rule_1();
-	gpu_rule_2();
-	gpu_rule_3();
-	gpu_rule_4();
-	gpu_rule_5();
-	gpu_simple_step();
+	auto next = std::chrono::steady_clock::now();
+
+	while (!done)
+	{
+		if (!is_active)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			next = std::chrono::steady_clock::now();
+			continue;
+		}
+
+		snapshot& frame = _snapshots.back();
+		frame.swarm.resize(swarm_size);
+		if (!step(events, frame.swarm.data(), &frame.predator))
+		{
+			clWaitForEvents(1, &events.back());
+			release_events(events);
+			break;
+		}
+		clWaitForEvents(1, &events.back());
+		if (profile)
+			profiler.collect(events);
+		release_events(events);
+
+		frame.time = std::chrono::steady_clock::now();
+		_snapshots.publish();
+		simulated_steps += substeps;
+
+		next += period;
+		if (next < frame.time - period)
+			next = frame.time;
+		std::this_thread::sleep_until(next);
+	}
 }
 
+/* Simulation and render rates, printed once a second. */
+class Rates
+{
+	public:
+		Rates ()
+		{
+			start = std::chrono::steady_clock::now();
+			frames = 0;
+			steps = simulated_steps;
+		}
+
+		void
+		frame ()
+		{
+			frames++;
+
+			auto now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - start).count();
+			if (seconds < 1.0)
+				return;
+
+			unsigned long long total = simulated_steps;
+			printf("simulation %.1f steps/s, render %.1f frames/s\n",
+			    (total - steps) / seconds, frames / seconds);
+
+			start = now;
+			frames = 0;
+			steps = total;
+		}
+
+	private:
+		std::chrono::steady_clock::time_point start;
+		unsigned int frames;
+		unsigned long long steps;
+};
+
+/* Draw at display rate while the simulation thread drives the device at its
+ * own rate. The renderer shows the state between the two latest frames, so
+ * the motion stays smooth when the two rates differ, at the cost of one frame
+ * of latency. */
 void
 main_loop ()
 {
+	if (lockstep)
+	{
+		lockstep_loop();
+		return;
+	}
+
+	TripleBuffer<snapshot> snapshots;
+	std::thread simulation(simulate, std::ref(snapshots));
+
+	snapshot previous;
+	std::vector<object> shown(swarm_size);
+	unsigned int received = 0;
+	Rates rates;
+
 	is_active = true;
 	SDL_Event event;
 
@@ -553,63 +1335,404 @@ main_loop ()
 			}
 		}
 
-			
-		if (is_active)
+		if (!is_active)
+			continue;
+
+		/* the front slot goes back to the writer, keep it for interpolation */
+		if (snapshots.fresh())
 		{
-			step();
+			if (received > 0)
+				previous = snapshots.front();
+			snapshots.acquire();
+			received++;
+		}
 
-			predator.velocity += hunt();
-			if (predator.velocity.length() > 0.2f)
-				predator.velocity /= 10.0f;
-			predator.position += predator.velocity;
+		if (received == 0)
+			continue;
 
-			draw_scene();
-			SDL_GL_SwapBuffers();
+		snapshot& latest = snapshots.front();
+		float alpha = 1.0f;
+		if (received > 1)
+		{
+			double interval = std::chrono::duration<double>(latest.time
+			    - previous.time).count();
+			double elapsed = std::chrono::duration<double>(
+			    std::chrono::steady_clock::now() - latest.time).count();
+			if (interval > 0.0)
+				alpha = std::min(elapsed / interval, 1.0);
+		}
+
+		if (alpha < 1.0f)
+		{
+			for (unsigned int i = 0; i < swarm_size; i++)
+				shown[i] = lerp(previous.swarm[i], latest.swarm[i], alpha);
+			swarm = shown.data();
+			predator = lerp(previous.predator, latest.predator, alpha);
 		}
+		else
+		{
+			swarm = latest.swarm.data();
+			predator = latest.predator;
+		}
+
+		draw_scene();
+		SDL_GL_SwapBuffers();
+		rates.frame();
 	}
+
+	simulation.join();
 }
 
-int 
-main (int argc, char *argv[])
+/* Read the rule weights of the swarms of an ensemble from _path, five numbers
+ * per swarm. Swarm e gets set e modulo the number of sets in the file, and
+ * without a file every weight is 1. */
+bool
+read_weights (const char* _path, unsigned int _swarms,
+    std::vector<weights>& _weights)
+{
+	std::vector<weights> sets;
+
+	if (_path == NULL)
+		sets.push_back({1.0f, 1.0f, 1.0f, 1.0f, 1.0f});
+	else
+	{
+		FILE* file = fopen(_path, "r");
+		if (file == NULL)
+		{
+			printf("Unable to open %s: %s\n", _path, strerror(errno));
+			return false;
+		}
+
+		weights w;
+		while (fscanf(file, "%f %f %f %f %f", &w.rule_1, &w.rule_2, &w.rule_3,
+		    &w.rule_4, &w.rule_5) == 5)
+			sets.push_back(w);
+
+		bool complete = feof(file);
+		fclose(file);
+
+		if (!complete || sets.empty())
+		{
+			printf("%s needs five rule weights per swarm.\n", _path);
+			return false;
+		}
+	}
+
+	_weights.resize(_swarms);
+	for (unsigned int e = 0; e < _swarms; e++)
+		_weights[e] = sets[e % sets.size()];
+
+	return true;
+}
+
+/* Step _swarms independent swarms of swarm_size mosquitoes with one launch of
+ * each ensemble kernel per step, then report the throughput and the final
+ * state of every swarm. Swarm e starts with mosquitoes e * swarm_size onwards
+ * of _seed and, like the single swarm, with its predator at the origin. */
+bool
+run_ensemble (unsigned int _swarms, unsigned int _steps, unsigned int _seed,
+    std::vector<weights>& _weights)
 {
-	work_group_size[0] = SWARM_SIZE;
+	uint64_t agents = (uint64_t)_swarms * swarm_size;
+	if (agents > UINT_MAX)
+	{
+		printf("An ensemble holds at most %u mosquitoes.\n", UINT_MAX);
+		return false;
+	}
+
+	/* the swarms lie one after the other, the two buffers take turns as the
+	 * current and the next state */
+	std::vector<object> swarms(agents);
+	std::vector<object> predators(_swarms);
+	cl_mem swarms_mem[2] = {NULL, NULL};
+	cl_mem predators_mem = NULL;
+	cl_mem weights_mem = NULL;
+
+	cl_int errors_kernel[2];
+	cl_kernel step_kernel = clCreateKernel(program, "ensemble_step",
+	    &errors_kernel[0]);
+	cl_kernel hunt_kernel = clCreateKernel(program, "ensemble_hunt",
+	    &errors_kernel[1]);
+
+	/* whatever was created, on the error paths as well as at the end */
+	auto release = [&] ()
+	{
+		if (step_kernel != NULL)
+			clReleaseKernel(step_kernel);
+		if (hunt_kernel != NULL)
+			clReleaseKernel(hunt_kernel);
+
+		for (cl_mem b : {swarms_mem[0], swarms_mem[1], predators_mem,
+		    weights_mem})
+			if (b != NULL)
+				clReleaseMemObject(b);
+	};
+
+	for (auto e : errors_kernel)
+		if (e != CL_SUCCESS)
+		{
+			printf("Unable to create the ensemble kernels: %d\n", e);
+			release();
+			return false;
+		}
+
+	cl_int errors_mem[4];
+	swarms_mem[0] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+	    sizeof(object) * agents, NULL, &errors_mem[0]);
+	swarms_mem[1] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+	    sizeof(object) * agents, NULL, &errors_mem[1]);
+	predators_mem = clCreateBuffer(context,
+	    CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, sizeof(object) * _swarms,
+	    predators.data(), &errors_mem[2]);
+	weights_mem = clCreateBuffer(context,
+	    CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, sizeof(weights) * _swarms,
+	    _weights.data(), &errors_mem[3]);
+	for (auto e : errors_mem)
+		if (e != CL_SUCCESS)
+		{
+			printf("Unable to allocate an ensemble of %u swarms: %d\n", _swarms,
+			    e);
+			release();
+			return false;
+		}
+
+	size_t local = requested_local;
+	cl_kernel kernels[] = {step_kernel, hunt_kernel};
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		size_t limit;
+		if (clGetKernelWorkGroupInfo(kernels[i], device, CL_KERNEL_WORK_GROUP_SIZE,
+		    sizeof(limit), &limit, NULL) == CL_SUCCESS)
+			local = std::min(local, limit);
+	}
+
+	/* dimension 1 is the swarm, a hunt takes one work-group per swarm */
+	size_t step_global[2] = {(swarm_size + local - 1) / local * local, _swarms};
+	size_t hunt_global[2] = {local, _swarms};
+	size_t group[2] = {local, 1};
+
+	err  = clSetKernelArg(step_kernel, 1, sizeof(cl_mem), &predators_mem);
+	err |= clSetKernelArg(step_kernel, 3, sizeof(cl_mem), &weights_mem);
+	err |= clSetKernelArg(step_kernel, 4, sizeof(unsigned int), &swarm_size);
+	err |= clSetKernelArg(hunt_kernel, 1, sizeof(cl_mem), &predators_mem);
+	err |= clSetKernelArg(hunt_kernel, 2, sizeof(unsigned int), &swarm_size);
+	err |= clSetKernelArg(hunt_kernel, 3, sizeof(candidate) * local, NULL);
+
+	if (err != CL_SUCCESS)
+		printf("Unable to set the ensemble kernel arguments: %d\n", err);
+	if (err != CL_SUCCESS
+	 || !random_swarm(swarms_mem[0], agents, _seed, NULL))
+	{
+		release();
+		return false;
+	}
+
+	clFinish(command_queue);
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned int s = 0; s < _steps && err == CL_SUCCESS; s++)
+	{
+		cl_mem current = swarms_mem[s % 2];
+		cl_mem next = swarms_mem[1 - s % 2];
+
+		err  = clSetKernelArg(step_kernel, 0, sizeof(cl_mem), &current);
+		err |= clSetKernelArg(step_kernel, 2, sizeof(cl_mem), &next);
+		err |= clEnqueueNDRangeKernel(command_queue, step_kernel, 2, NULL,
+		    step_global, group, 0, NULL, NULL);
+
+		/* the predators hunt in the new state */
+		err |= clSetKernelArg(hunt_kernel, 0, sizeof(cl_mem), &next);
+		err |= clEnqueueNDRangeKernel(command_queue, hunt_kernel, 2, NULL,
+		    hunt_global, group, 0, NULL, NULL);
+	}
 
-	srand(time(NULL));
+	if (err == CL_SUCCESS)
+		err = clFinish(command_queue);
+	double seconds = std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - start).count();
+
+	if (err == CL_SUCCESS)
+		err = clEnqueueReadBuffer(command_queue, swarms_mem[_steps % 2], CL_TRUE,
+		    0, sizeof(object) * agents, swarms.data(), 0, NULL, NULL);
+	if (err == CL_SUCCESS)
+		err = clEnqueueReadBuffer(command_queue, predators_mem, CL_TRUE, 0,
+		    sizeof(object) * _swarms, predators.data(), 0, NULL, NULL);
+
+	release();
+
+	if (err != CL_SUCCESS)
+	{
+		printf("Unable to step the ensemble: %d\n", err);
+		return false;
+	}
 
-	for (unsigned int i = 0; i < SWARM_SIZE; i++)
+	printf("swarms: %u\nsize: %u\nsteps: %u\n", _swarms, swarm_size, _steps);
+	printf("seconds: %.3f\n", seconds);
+	printf("swarm-steps/sec: %.2f\n", (double)_swarms * _steps / seconds);
+	printf("agent-steps/sec: %.4g\n", (double)agents * _steps / seconds);
+
+	/* the centre of mass and the mean distance to it of every swarm */
+	for (unsigned int e = 0; e < _swarms; e++)
+	{
+		object* swarm = &swarms[(size_t)e * swarm_size];
+		double x = 0.0;
+		double y = 0.0;
+		for (unsigned int i = 0; i < swarm_size; i++)
+		{
+			x += swarm[i].position.x;
+			y += swarm[i].position.y;
+		}
+		x /= swarm_size;
+		y /= swarm_size;
+
+		double spread = 0.0;
+		for (unsigned int i = 0; i < swarm_size; i++)
+			spread += hypot(swarm[i].position.x - x, swarm[i].position.y - y);
+		spread /= swarm_size;
+
+		weights& w = _weights[e];
+		printf("swarm %u: weights %g %g %g %g %g, centre %.1f %.1f, spread %.1f, "
+		    "predator %.1f %.1f\n", e, w.rule_1, w.rule_2, w.rule_3, w.rule_4,
+		    w.rule_5, x, y, spread, predators[e].position.x,
+		    predators[e].position.y);
+	}
+
+	return true;
+}
+
+int 
+main (int argc, char *argv[])
+{
+	/* --split selects the per-rule kernels instead of the fused one,
+	 * --sync waits for every frame before rendering it, --overlap reports how
+	 * much of the frame time the pipelining hides, --profile prints the
+	 * timings of every kernel and read at the end, --immediate draws every
+	 * mosquito with its own glBegin/glEnd, --device takes "platform:device"
+	 * or "auto" instead of asking for them, --tiled reads the swarm through
+	 * local memory tiles, --local sets the work-group size and so the tile,
+	 * --size sets the number of mosquitoes, --substeps the number of steps
+	 * computed on the device for every frame, --sim-rate the frames per second
+	 * of the simulation thread (0 for as fast as possible), --lockstep steps
+	 * and draws on one thread, to which --sync and --overlap apply, --seed
+	 * sets the seed of the swarm, --ensemble steps that many swarms of --size
+	 * mosquitoes for --steps steps with the fused kernel and the rule weights
+	 * of --weights, and prints the result without rendering, --rules loads
+	 * the constants of the rules that the kernels are compiled with */
+	unsigned int seed = time(NULL);
+	unsigned int steps = 1000;
+	const char* weights_path = NULL;
+	const char* rules_path = NULL;
+	for (int i = 1; i < argc; i++)
 	{
-		swarm[i].position.x = rand() % 600;
-		swarm[i].position.y = rand() % 600;
+		if (strcmp(argv[i], "--split") == 0)
+			split_kernels = true;
+		else if (strcmp(argv[i], "--sync") == 0)
+			pipelined = false;
+		else if (strcmp(argv[i], "--overlap") == 0)
+			report_overlap = true;
+		else if (strcmp(argv[i], "--profile") == 0)
+			profile = true;
+		else if (strcmp(argv[i], "--immediate") == 0)
+			batched = false;
+		else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+			device_choice = argv[++i];
+		else if (strcmp(argv[i], "--tiled") == 0)
+			tiled = true;
+		else if (strcmp(argv[i], "--local") == 0 && i + 1 < argc)
+			requested_local = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+			swarm_size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--substeps") == 0 && i + 1 < argc)
+			substeps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--sim-rate") == 0 && i + 1 < argc)
+			simulation_rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "--lockstep") == 0)
+			lockstep = true;
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc)
+			ensemble_size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+			steps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc)
+			weights_path = argv[++i];
+		else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc)
+			rules_path = argv[++i];
+		else
+		{
+			printf("Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
 
-		swarm[i].velocity.x = (float)(rand() % 1000) / 1000.0f - 0.5f;
-		swarm[i].velocity.y = (float)(rand() % 1000) / 1000.0f - 0.5f;
+	/* every mosquito needs at least one other one */
+	if (swarm_size < 2 || requested_local == 0 || substeps == 0)
+	{
+		printf("Invalid swarm size, work-group size or number of substeps.\n");
+		return 1;
 	}
 
-	if (!platform_selection())
+	host_swarm[0].resize(swarm_size);
+	host_swarm[1].resize(swarm_size);
+	swarm = host_swarm[0].data();
+	random_seed = seed;
+
+	if (rules_path != NULL && !rules.load(rules_path))
 		return 1;
+	build_options = rules.options();
 
-	if (!device_selection())
+	std::vector<weights> ensemble_weights;
+	if (ensemble_size > 0
+	 && !read_weights(weights_path, ensemble_size, ensemble_weights))
 		return 1;
 
-	if (!init_cl())
+	if (device_choice == NULL)
+		device_choice = getenv("KOMARNO_DEVICE");
+
+	if (report_overlap || profile)
+		queue_properties = CL_QUEUE_PROFILING_ENABLE;
+
+	if (!choose_device(swarm_size) || !init_cl())
 		return 1;
 
-	if (!build_cl_program("source.cl"))
+	if (ensemble_size > 0)
+	{
+		if (!build_cl_program("source.cl"))
+			return 1;
+
+		if (!run_ensemble(ensemble_size, steps, seed, ensemble_weights))
+			return 1;
+
+		return EXIT_SUCCESS;
+	}
+
+	/* compile the kernels while the window is being set up */
+	bool built = false;
+	std::thread builder([&] { built = build_cl_program("source.cl"); });
+
+  init_sdl();
+	init_opengl();
+
+	builder.join();
+	if (!built)
 		return 1;
-	
+
 	if (!extract_kernels())
 		return 1;
 
 	if (!setup_memory())
 		return 1;
 
-	if (!setup_kernel_arguments())
+	if (!random_swarm(swarm_mem, swarm_size, seed, host_swarm[0].data()))
 		return 1;
 
-  init_sdl();
-	init_opengl();
+	if (!setup_kernel_arguments())
+		return 1;
 
 	main_loop();
+
+	if (profile)
+		profiler.print();
 	
 	return EXIT_SUCCESS;	
 }
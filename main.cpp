@@ -3,7 +3,18 @@
 #include <stdio.h>
 #include <cmath>
 #include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <stdint.h>
+#include <limits.h>
 #include <SDL/SDL.h>
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
@@ -12,24 +23,321 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+
+#include "device.h"
+#include "cpu.h"
 
 SDL_Surface *surface;
-bool done = false;
-bool is_active = true;
+std::atomic<bool> done(false);
+std::atomic<bool> is_active(true);
+bool brute_force = false;
+bool validate = false;
+bool compensated = false;
+
+/* rule 5 counts only the dragonflies closer than this, 0 counts all of them */
+float fear_radius = 0.0f;
+
+/* draw the swarm with one vertex array instead of a quad per mosquito */
+bool batched = true;
+
+/* step and draw in turns on one thread instead of a simulation thread */
+bool lockstep = false;
+
+/* steps per second of the simulation thread, 0 runs it as fast as it can */
+double simulation_rate = 60.0;
+
+/* The constants of the rules as compiled in, overridden with -D options, for
+ * example -DRULE_SEPARATION=25.0f. The vector kernels are instantiated for
+ * these, which folds the constants into the code, and for any rules loaded
+ * at run time. */
+#ifndef RULE_COHESION
+#define RULE_COHESION 50.0f
+#endif
+#ifndef RULE_SEPARATION
+#define RULE_SEPARATION 20.0f
+#endif
+#ifndef RULE_ALIGNMENT
+#define RULE_ALIGNMENT 2.0f
+#endif
+#ifndef RULE_BORDER
+#define RULE_BORDER 20.0f
+#endif
+#ifndef RULE_BORDER_SCALE
+#define RULE_BORDER_SCALE 0.1f
+#endif
+#ifndef RULE_FEAR
+#define RULE_FEAR 60.0f
+#endif
+#ifndef RULE_INERTIA
+#define RULE_INERTIA 10000.0f
+#endif
+#ifndef RULE_SPEED_LIMIT
+#define RULE_SPEED_LIMIT 0.6f
+#endif
+#ifndef RULE_SLOWDOWN
+#define RULE_SLOWDOWN 10.0f
+#endif
+#ifndef RULE_CHASE
+#define RULE_CHASE 35.0f
+#endif
+#ifndef RULE_PREDATOR_SPEED_LIMIT
+#define RULE_PREDATOR_SPEED_LIMIT 0.2f
+#endif
+#ifndef RULE_WORLD
+#define RULE_WORLD 600.0f
+#endif
+
+/* The constants of the rules. Rule 1 divides the way to the centre of mass by
+ * cohesion, rule 2 keeps mosquitoes separation apart, rule 3 divides the
+ * difference to the mean velocity by alignment, rule 4 pushes with border
+ * over the distance to each border, divided by border_scale, and rule 5
+ * divides the way from the dragonflies by fear. The sum of the rules is
+ * divided by inertia. A mosquito at speed_limit or faster, or a dragonfly at
+ * predator_speed_limit or faster, slows down by the factor slowdown, and a
+ * dragonfly steers towards its prey by its distance over chase. The world is
+ * world by world units. The OpenCL kernels have neither cohesion nor
+ * speed_limit, their rule 1 and limit differ, see Rules in gpu.cpp. */
+class Rules
+{
+	public:
+		Rules ()
+		{
+			cohesion = RULE_COHESION;
+			separation = RULE_SEPARATION;
+			alignment = RULE_ALIGNMENT;
+			border = RULE_BORDER;
+			border_scale = RULE_BORDER_SCALE;
+			fear = RULE_FEAR;
+			inertia = RULE_INERTIA;
+			speed_limit = RULE_SPEED_LIMIT;
+			slowdown = RULE_SLOWDOWN;
+			chase = RULE_CHASE;
+			predator_speed_limit = RULE_PREDATOR_SPEED_LIMIT;
+			world = RULE_WORLD;
+		}
+
+		/* Read "name value" lines from _path, # starts a comment. Rules that
+		 * are not named keep their value. */
+		bool
+		load (const char* _path)
+		{
+			FILE* file = fopen(_path, "r");
+			if (file == NULL)
+			{
+				printf("Unable to open %s: %s\n", _path, strerror(errno));
+				return false;
+			}
+
+			char line[256];
+			unsigned int number = 0;
+			bool valid = true;
+			while (valid && fgets(line, sizeof(line), file) != NULL)
+			{
+				number++;
+				line[strcspn(line, "#")] = '\0';
+
+				char name[64];
+				float value;
+				char rest;
+				int fields = sscanf(line, "%63s %f %c", name, &value, &rest);
+				if (fields <= 0)
+					continue;
+
+				float* rule = (fields == 2) ? find(name) : NULL;
+				if (rule == NULL || !(value > 0.0f))
+				{
+					printf("%s:%u: expected a rule and a positive value\n", _path,
+					    number);
+					valid = false;
+				}
+				else
+					*rule = value;
+			}
+			fclose(file);
+
+			return valid;
+		}
+
+		/* The -D options that compile the rules source.cl shares into it. Its
+		 * rule 1 and limit keep the constants of gpu.cpp, so the device runs
+		 * the model gpu.cpp runs. Nine digits give back every float exactly. */
+		std::string
+		options ()
+		{
+			std::string result;
+
+			for (auto& n : names())
+			{
+				if (n.macro == NULL)
+					continue;
+
+				char definition[64];
+				snprintf(definition, sizeof(definition), " -D RULE_%s=%#.9gf",
+				    n.macro, *n.value);
+				result += definition;
+			}
+
+			return result;
+		}
+
+		bool
+		operator== (const Rules& _other) const
+		{
+			return memcmp(this, &_other, sizeof(Rules)) == 0;
+		}
+
+		float cohesion;
+		float separation;
+		float alignment;
+		float border;
+		float border_scale;
+		float fear;
+		float inertia;
+		float speed_limit;
+		float slowdown;
+		float chase;
+		float predator_speed_limit;
+		float world;
+
+	private:
+		/* macro is NULL for the rules the kernels of source.cl do not have */
+		struct Name
+		{
+			const char* name;
+			const char* macro;
+			float* value;
+		};
+
+		std::vector<Name>
+		names ()
+		{
+			return {
+				{"cohesion", NULL, &cohesion},
+				{"separation", "SEPARATION", &separation},
+				{"alignment", "ALIGNMENT", &alignment},
+				{"border", "BORDER", &border},
+				{"border_scale", "BORDER_SCALE", &border_scale},
+				{"fear", "FEAR", &fear},
+				{"inertia", "INERTIA", &inertia},
+				{"speed_limit", NULL, &speed_limit},
+				{"slowdown", "SLOWDOWN", &slowdown},
+				{"chase", "CHASE", &chase},
+				{"predator_speed_limit", "PREDATOR_SPEED_LIMIT", &predator_speed_limit},
+				{"world", "WORLD", &world}
+			};
+		}
+
+		float*
+		find (const char* _name)
+		{
+			for (auto& n : names())
+				if (strcmp(n.name, _name) == 0)
+					return n.value;
+
+			return NULL;
+		}
+};
+
+/* --rules of the run, the compiled rules unless a file changes them */
+Rules rules;
+
+/* The rules for the kernel templates: constant expressions of the compiled
+ * rules, or the values loaded at run time. */
+class CompiledRules
+{
+	public:
+		static constexpr float cohesion () { return RULE_COHESION; }
+		static constexpr float separation () { return RULE_SEPARATION; }
+		static constexpr float alignment () { return RULE_ALIGNMENT; }
+		static constexpr float border () { return RULE_BORDER; }
+		static constexpr float border_scale () { return RULE_BORDER_SCALE; }
+		static constexpr float fear () { return RULE_FEAR; }
+		static constexpr float inertia () { return RULE_INERTIA; }
+		static constexpr float speed_limit () { return RULE_SPEED_LIMIT; }
+		static constexpr float slowdown () { return RULE_SLOWDOWN; }
+		static constexpr float world () { return RULE_WORLD; }
+};
+
+class RuntimeRules
+{
+	public:
+		static float cohesion () { return rules.cohesion; }
+		static float separation () { return rules.separation; }
+		static float alignment () { return rules.alignment; }
+		static float border () { return rules.border; }
+		static float border_scale () { return rules.border_scale; }
+		static float fear () { return rules.fear; }
+		static float inertia () { return rules.inertia; }
+		static float speed_limit () { return rules.speed_limit; }
+		static float slowdown () { return rules.slowdown; }
+		static float world () { return rules.world; }
+};
+
+/* run the kernels instantiated for the compiled rules, cleared when --rules
+ * loads different ones */
+bool specialised = true;
+
+/* --seed of the run, the key of every random number */
+unsigned int random_seed = 0;
+
+/* Independent sequences of random numbers under the same seed. */
+const uint32_t RANDOM_MOSQUITOES = 0;
+const uint32_t RANDOM_DRAGONFLIES = 1;
+
+/* The Philox4x32-10 counter-based generator of Salmon et al.: four random
+ * words for each counter, under a key of the seed and the sequence. Agent i
+ * draws from counter i, so its values do not depend on which thread or
+ * device computes them, or in which order. gpu.cpp and source.cl have the
+ * same function. */
+void
+philox (uint32_t _counter, uint32_t _seed, uint32_t _sequence, uint32_t _out[4])
+{
+	uint32_t c0 = _counter;
+	uint32_t c1 = 0;
+	uint32_t c2 = 0;
+	uint32_t c3 = 0;
+	uint32_t k0 = _seed;
+	uint32_t k1 = _sequence;
+
+	for (unsigned int round = 0; round < 10; round++)
+	{
+		uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+		uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
 
-cl_context context;
-cl_int err;
+	_out[0] = c0;
+	_out[1] = c1;
+	_out[2] = c2;
+	_out[3] = c3;
+}
 
-cl_device_id* devices;
-cl_device_id device;
-cl_uint num_devices;
+/* An integer in [0, _range) from the high bits of _word * _range, cheaper than
+ * the remainder. */
+uint32_t
+random_below (uint32_t _word, uint32_t _range)
+{
+	return (uint32_t)(((uint64_t)_word * _range) >> 32);
+}
 
-cl_platform_id* platforms;
-cl_platform_id platform;
-cl_uint num_platforms;
+/* A velocity component in [-0.5, 0.5) in steps of 0.001. The product is the
+ * only rounding, so OpenCL devices compute the same float. */
+float
+random_velocity (uint32_t _word)
+{
+	return (float)((int)random_below(_word, 1000) - 500) * 0.001f;
+}
 
-cl_command_queue command_queue;
-cl_program program;
 cl_event event;
 
 cl_kernel rule_1_kernel;
@@ -74,7 +382,7 @@ resize_viewport ()
 {
   glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
-	glOrtho(0, 600, 600, 0, -1, 1);
+	glOrtho(0, rules.world, rules.world, 0, -1, 1);
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 	glDisable(GL_DEPTH_TEST);
@@ -117,24 +425,24 @@ class Mosquito
 		Vector2 velocity;
 		Vector2 position;
 
+		/* Mosquito _index of the swarm of _seed, in one of the two corner
+		 * squares of the world. The positions are drawn on the 600 by 600
+		 * grid of the default world and scaled to the actual one. */
 		static Mosquito
-		random ()
+		random (uint32_t _seed, uint32_t _index)
 		{
 			Mosquito m;
+			uint32_t words[4];
+			philox(_index, _seed, RANDOM_MOSQUITOES, words);
 
-			m.velocity.x = (float)(rand() % 1000) / 1000.0f - 0.5f;
-			m.velocity.y = (float)(rand() % 1000) / 1000.0f - 0.5f;
+			m.velocity.x = random_velocity(words[0]);
+			m.velocity.y = random_velocity(words[1]);
 
-			if (rand() % 2 == 0)
-			{
-				m.position.x = (float)(rand() % 300);
-				m.position.y = (float)(rand() % 300);
-			}
-			else
-			{
-				m.position.x = (float)(rand() % 300) + 300;
-				m.position.y = (float)(rand() % 300) + 300;
-			}
+			/* the lowest bit picks the square, the high bits the position */
+			float corner = (words[2] & 1) ? 300.0f : 0.0f;
+			float scale = rules.world / 600.0f;
+			m.position.x = ((float)random_below(words[2], 300) + corner) * scale;
+			m.position.y = ((float)random_below(words[3], 300) + corner) * scale;
 
 			return m;
 		}
@@ -165,14 +473,16 @@ class Dragonfly
 		Vector2 position;
 
 		static Dragonfly 
-		random ()
+		random (uint32_t _seed, uint32_t _index)
 		{
 			Dragonfly d;
+			uint32_t words[4];
+			philox(_index, _seed, RANDOM_DRAGONFLIES, words);
 
-			d.velocity.x = (float)(rand() % 1000) / 1000.0f - 0.5f;
-			d.velocity.y = (float)(rand() % 1000) / 1000.0f - 0.5f;
-			d.position.x = (float)(rand() % 600);
-			d.position.y = (float)(rand() % 600);
+			d.velocity.x = random_velocity(words[0]);
+			d.velocity.y = random_velocity(words[1]);
+			d.position.x = (float)random_below(words[2], 600) * (rules.world / 600.0f);
+			d.position.y = (float)random_below(words[3], 600) * (rules.world / 600.0f);
 
 			return d;
 		}
@@ -195,408 +505,4064 @@ class Dragonfly
 		}
 };
 
-Vector2
-operator+ (Vector2 const& _a, Vector2 const& _b)
+/* Structure-of-arrays storage of the swarm, so that each rule streams only the
+ * components it needs. */
+class SwarmState
 {
-	Vector2 result;
-	result.x = _a.x + _b.x;
-	result.y = _a.y + _b.y;
+	public:
+		void
+		resize (unsigned int _size)
+		{
+			position_x.resize(_size);
+			position_y.resize(_size);
+			velocity_x.resize(_size);
+			velocity_y.resize(_size);
+		}
 
-	return result;
-}
+		unsigned int
+		size ()
+		{
+			return position_x.size();
+		}
 
-Vector2
-operator- (Vector2 const& _a, Vector2 const& _b)
-{
-	Vector2 result;
-	result.x = _a.x - _b.x;
-	result.y = _a.y - _b.y;
+		Vector2
+		position (unsigned int _i)
+		{
+			return Vector2(position_x[_i], position_y[_i]);
+		}
 
-	return result;
-}
+		Vector2
+		velocity (unsigned int _i)
+		{
+			return Vector2(velocity_x[_i], velocity_y[_i]);
+		}
 
-Vector2&
-operator/= (Vector2& _v, float _s)
-{
-  _v.x /= _s;
-  _v.y /= _s;
+		Mosquito
+		get (unsigned int _i)
+		{
+			Mosquito m;
+			m.position = position(_i);
+			m.velocity = velocity(_i);
 
-  return _v;
-}
+			return m;
+		}
 
-Vector2&
-operator+= (Vector2 & _a, Vector2 const& _b)
-{
-  _a.x += _b.x;
-  _a.y += _b.y;
+		void
+		set (unsigned int _i, Mosquito& _m)
+		{
+			position_x[_i] = _m.position.x;
+			position_y[_i] = _m.position.y;
+			velocity_x[_i] = _m.velocity.x;
+			velocity_y[_i] = _m.velocity.y;
+		}
 
-  return _a;
-}
+		std::vector<float> position_x;
+		std::vector<float> position_y;
+		std::vector<float> velocity_x;
+		std::vector<float> velocity_y;
+};
 
-Vector2&
-operator-= (Vector2& _a, Vector2& _b)
+/* Persistent front and back buffers of the swarm. A step reads the front,
+ * writes the back and swaps them, so no memory is allocated while running. */
+class Swarm
 {
-  _a.x -= _b.x;
-  _a.y -= _b.y;
-
-  return _a;
-}
+	public:
+		Swarm (unsigned int _size)
+		{
+			buffers[0].resize(_size);
+			buffers[1].resize(_size);
+			current = 0;
+		}
 
-Vector2
-rule_1 (Mosquito& _m, std::vector<Mosquito> _swarm)
-{
-	Vector2 mass_centre;
+		SwarmState&
+		front ()
+		{
+			return buffers[current];
+		}
 
-	for (auto& m : _swarm)
-	{
-		if (&_m != &m)
-			mass_centre += m.position;
-	}
-	mass_centre /= (_swarm.size() - 1);
+		SwarmState&
+		back ()
+		{
+			return buffers[1 - current];
+		}
 
-	Vector2 direction = mass_centre - _m.position;	
-	direction /= 50.0f;
+		void
+		swap ()
+		{
+			current = 1 - current;
+		}
 
-	return direction;
-}
+	private:
+		SwarmState buffers[2];
+		unsigned int current;
+};
 
-Vector2
-rule_2 (Mosquito& _m, std::vector<Mosquito> _swarm)
+/* Persistent pool of worker threads. A parallel loop is split into chunks,
+ * the chunks are dealt out to the workers in contiguous ranges, and a worker
+ * that runs out of its own chunks steals from the end of the others' ranges.
+ * The calling thread takes part as worker 0, and no threads are created while
+ * running. */
+class ThreadPool
 {
-	Vector2 centre;
+	public:
+		typedef void (*Task) (void* _context, unsigned int _chunk);
 
-	for(auto& m : _swarm)
-	{
-		if (&_m != &m)
+		ThreadPool (unsigned int _threads)
 		{
-			Vector2 difference = m.position - _m.position;
-			if (difference.length() < 20.0f)
-				centre -= difference;
+			size = std::max(_threads, 1u);
+			ranges = new std::atomic<uint64_t>[size];
+			for (unsigned int i = 0; i < size; i++)
+				ranges[i] = 0;
+
+			generation = 0;
+			busy = 0;
+			stop = false;
+
+			for (unsigned int i = 1; i < size; i++)
+				threads.push_back(std::thread(&ThreadPool::worker, this, i));
 		}
-	}
 
-	return centre;
-}
+		~ThreadPool ()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			wake.notify_all();
 
-Vector2
-rule_3 (Mosquito& _m, std::vector<Mosquito> _swarm)
-{
-	Vector2 velocity;
+			for (auto& t : threads)
+				t.join();
 
-	for(auto& m : _swarm)
-	{
-		if (&_m != &m)
+			delete[] ranges;
+		}
+
+		/* Call _function(chunk) for every chunk in [0, _chunks) and wait for all
+		 * of them to finish. */
+		template <typename F>
+		void
+		parallel_for (unsigned int _chunks, F& _function)
 		{
-			velocity += m.velocity;
+			run(_chunks, [] (void* _context, unsigned int _chunk)
+			    { (*(F*)_context)(_chunk); }, &_function);
 		}
-	}
-	velocity /= (float)(_swarm.size() - 1);
 
-	Vector2 result;
-	result = velocity - _m.velocity;
-	result /= 2.0f;
+		unsigned int size;
 
-	return result;
-}
+	private:
+		static uint64_t
+		pack (uint32_t _begin, uint32_t _end)
+		{
+			return ((uint64_t)_end << 32) | _begin;
+		}
 
-Vector2
-rule_4 (Mosquito& _m)
-{
-	Vector2 top_velocity;
-	Vector2 bottom_velocity;
-	Vector2 left_velocity;
-	Vector2 right_velocity;
+		void
+		run (unsigned int _chunks, Task _task, void* _context)
+		{
+			if (size == 1)
+			{
+				for (unsigned int c = 0; c < _chunks; c++)
+					_task(_context, c);
+				return;
+			}
 
-	if (_m.position.x == 0.0f || _m.position.y == 0.0f ||
-	    _m.position.x == 600.0f || _m.position.y == 600.0f)
-		return Vector2();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
 
-	top_velocity.y = fabs(20.0f / _m.position.y);	
-	bottom_velocity.y = -fabs(20.0f / (_m.position.y - 600.0f));	
-	left_velocity.x = fabs(20.0f / _m.position.x);	
-	right_velocity.x = -fabs(20.0f / (_m.position.x - 600.0f));	
+				for (unsigned int i = 0; i < size; i++)
+					ranges[i] = pack((uint64_t)_chunks * i / size,
+					    (uint64_t)_chunks * (i + 1) / size);
 
-	Vector2 result = top_velocity + bottom_velocity + left_velocity +
-	    right_velocity;
+				task = _task;
+				context = _context;
+				busy = size - 1;
+				generation++;
+			}
+			wake.notify_all();
 
-	result /= 0.1f;
+			work(0);
 
-	return result;
-}
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this] { return busy == 0; });
+		}
 
-Vector2
-rule_5 (Mosquito& _m, Dragonfly& _d)
-{
-	Vector2 result = _m.position - _d.position;
-	result /= 60.0;
+		/* take a chunk from the front of the own range */
+		bool
+		take (unsigned int _id, unsigned int& _chunk)
+		{
+			uint64_t range = ranges[_id].load();
 
-	return result;
-}
+			while ((uint32_t)range < (uint32_t)(range >> 32))
+			{
+				if (ranges[_id].compare_exchange_weak(range,
+				    pack((uint32_t)range + 1, range >> 32)))
+				{
+					_chunk = (uint32_t)range;
+					return true;
+				}
+			}
 
-Vector2
-hunt (Dragonfly& _d, std::vector<Mosquito>& _swarm)
-{
-	Vector2 closest = _d.position - _swarm[0].position;
+			return false;
+		}
 
-	for (auto& m : _swarm)
-		if ((_d.position - m.position).length() < closest.length())
-			closest = (_d.position - m.position);
+		/* take a chunk from the end of another worker's range */
+		bool
+		steal (unsigned int _id, unsigned int& _chunk)
+		{
+			for (unsigned int i = 1; i < size; i++)
+			{
+				unsigned int victim = (_id + i) % size;
+				uint64_t range = ranges[victim].load();
 
-	closest /= -35.0f;
+				while ((uint32_t)range < (uint32_t)(range >> 32))
+				{
+					if (ranges[victim].compare_exchange_weak(range,
+					    pack((uint32_t)range, (range >> 32) - 1)))
+					{
+						_chunk = (range >> 32) - 1;
+						return true;
+					}
+				}
+			}
 
-	return closest;
-}
+			return false;
+		}
 
-void
-draw_scene (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
-{
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+		void
+		work (unsigned int _id)
+		{
+			unsigned int chunk;
 
-	for (auto& m : _swarm)
-		m.draw();
+			while (take(_id, chunk) || steal(_id, chunk))
+				task(context, chunk);
+		}
 
-	_dragonfly.draw();
-}
+		void
+		worker (unsigned int _id)
+		{
+			unsigned long seen = 0;
 
-std::vector<Mosquito>
-step (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
-{
-	std::vector<Mosquito> new_swarm;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&] { return stop || generation != seen; });
 
-	for (auto& m : _swarm)
-	{
-		Vector2 v1 = rule_1(m, _swarm);
-		Vector2 v2 = rule_2(m, _swarm);
-		Vector2 v3 = rule_3(m, _swarm);
-		Vector2 v4 = rule_4(m);
-		Vector2 v5 = rule_5(m, _dragonfly);
+					if (stop)
+						return;
+					seen = generation;
+				}
 
-		Vector2 velocity;
-		velocity += v1;
-		velocity += v2;
-		velocity += v3;
-		velocity += v4;
-		velocity += v5;
+				work(_id);
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					busy--;
+				}
+				done.notify_one();
+			}
+		}
 
-		velocity /= 10000.0f;
+		std::vector<std::thread> threads;
+		std::atomic<uint64_t>* ranges;
 
-		Mosquito new_mosquito;
-		new_mosquito.velocity = m.velocity + velocity;
-		new_mosquito.position = m.position + new_mosquito.velocity;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+		unsigned long generation;
+		unsigned int busy;
+		bool stop;
 
-		if (new_mosquito.velocity.length() > 0.6)
-			new_mosquito.velocity /= 10.0f;
+		Task task;
+		void* context;
+};
 
-		new_swarm.push_back(new_mosquito);
-	}
+ThreadPool* pool;
 
-	return new_swarm;
+/* the pool of the renderer, which must not share the pool with a step
+ * running on the simulation thread */
+ThreadPool* render_pool;
+
+/* Number of mosquitoes in one unit of parallel work. The chunks do not depend
+ * on the number of threads, and neither do the results. It is a multiple of
+ * the widest vector, so that every mosquito always takes the same code path. */
+const unsigned int CHUNK_SIZE = 1024;
+
+unsigned int
+chunk_count (unsigned int _size)
+{
+	return (_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
 }
 
-void
-main_loop (std::vector<Mosquito>& _swarm, Dragonfly& _dragonfly)
+/* Uniform grid over the pond with cells of the personal space radius. Each
+ * step the swarm indices are counting-sorted by cell, so that rule 2 only has
+ * to visit the 3x3 cells around a mosquito. Positions outside the pond are
+ * clamped to the border cells, which keeps the neighbourhood search exact. */
+class Grid
 {
-	is_active = true;
-	SDL_Event event;
+	public:
+		Grid (float _cell_size = RULE_SEPARATION, float _extent = RULE_WORLD)
+		{
+			cell_size = _cell_size;
+			side = (unsigned int)ceilf(_extent / _cell_size);
+			cell_start.resize(side * side + 1);
+		}
 
-	while (!done)
-	{
-		while (SDL_PollEvent(&event))
+		unsigned int
+		coordinate (float _c)
 		{
-			switch (event.type)
-			{
-				case SDL_ACTIVEEVENT:
-					if (event.active.state == SDL_APPACTIVE )
-						is_active = (event.active.gain != 0);
-				break;
+			float c = _c / cell_size;
 
-				case SDL_QUIT:
-					done = true; 
-				break;
+			/* negative values and NaNs go to the first cell */
+			if (!(c >= 0.0f))
+				return 0;
 
-				default:
-				break;
-			}
+			if (c >= (float)(side - 1))
+				return side - 1;
+
+			return (unsigned int)c;
 		}
 
-			
-		if (is_active)
+		void
+		build (SwarmState& _swarm)
 		{
-			_swarm = step(_swarm, _dragonfly);
-			_dragonfly.velocity += hunt(_dragonfly, _swarm);
-			if (_dragonfly.velocity.length() > 0.2)
-				_dragonfly.velocity /= 10.0f;
-			_dragonfly.position += _dragonfly.velocity;
+			cell_of.resize(_swarm.size());
+			indices.resize(_swarm.size());
+			std::fill(cell_start.begin(), cell_start.end(), 0);
 
-			draw_scene(_swarm, _dragonfly);
-			SDL_GL_SwapBuffers();
-		}
-	}
-}
+			for (unsigned int i = 0; i < _swarm.size(); i++)
+			{
+				cell_of[i] = coordinate(_swarm.position_y[i]) * side
+				    + coordinate(_swarm.position_x[i]);
+				cell_start[cell_of[i] + 1]++;
+			}
 
-bool
-platform_selection ()
+			for (unsigned int c = 0; c < side * side; c++)
+				cell_start[c + 1] += cell_start[c];
+
+			cursor.assign(cell_start.begin(), cell_start.end() - 1);
+			for (unsigned int i = 0; i < _swarm.size(); i++)
+				indices[cursor[cell_of[i]]++] = i;
+
+			/* copy of the positions in the cell order for the vector kernels */
+			sorted_x.resize(_swarm.size());
+			sorted_y.resize(_swarm.size());
+			for (unsigned int k = 0; k < _swarm.size(); k++)
+			{
+				sorted_x[k] = _swarm.position_x[indices[k]];
+				sorted_y[k] = _swarm.position_y[indices[k]];
+			}
+		}
+
+		/* Ranges of the sorted order that cover the 3x3 cells around a point.
+		 * The neighbouring cells of one row are adjacent in the sorted order,
+		 * so there is one range per row. Returns the number of rows. */
+		unsigned int
+		neighbour_rows (float _x, float _y, unsigned int* _from, unsigned int* _to)
+		{
+			unsigned int x = coordinate(_x);
+			unsigned int y = coordinate(_y);
+			unsigned int x_from = (x == 0) ? 0 : x - 1;
+			unsigned int x_to = std::min(x + 1, side - 1);
+			unsigned int y_from = (y == 0) ? 0 : y - 1;
+			unsigned int y_to = std::min(y + 1, side - 1);
+
+			unsigned int rows = 0;
+			for (unsigned int row = y_from; row <= y_to; row++, rows++)
+			{
+				_from[rows] = cell_start[row * side + x_from];
+				_to[rows] = cell_start[row * side + x_to + 1];
+			}
+
+			return rows;
+		}
+
+		/* Index of the mosquito nearest to a point, or UINT_MAX for an empty
+		 * grid. The cells are visited in growing square rings around the
+		 * point until no unvisited cell can hold a nearer mosquito; the border
+		 * cells hold everything beyond the pond, so a ring that reaches the
+		 * border covers that whole side. Ties go to the lower index, as in a
+		 * linear scan. */
+		unsigned int
+		nearest (float _x, float _y)
+		{
+			unsigned int x = coordinate(_x);
+			unsigned int y = coordinate(_y);
+			unsigned int best = UINT_MAX;
+			float best_length = INFINITY;
+
+			auto visit = [&] (unsigned int _from, unsigned int _to)
+			{
+				for (unsigned int k = _from; k < _to; k++)
+				{
+					float dx = _x - sorted_x[k];
+					float dy = _y - sorted_y[k];
+					float length = sqrtf(dx * dx + dy * dy);
+
+					if (length < best_length
+					 || (length == best_length && indices[k] < best))
+					{
+						best = indices[k];
+						best_length = length;
+					}
+				}
+			};
+
+			for (unsigned int ring = 0; ; ring++)
+			{
+				unsigned int x_from = (x < ring) ? 0 : x - ring;
+				unsigned int x_to = std::min(x + ring, side - 1);
+				unsigned int y_from = (y < ring) ? 0 : y - ring;
+				unsigned int y_to = std::min(y + ring, side - 1);
+
+				for (unsigned int row = y_from; row <= y_to; row++)
+				{
+					/* the first and the last row of the ring are whole, the
+					 * others have only its two columns */
+					if (row + ring == y || row == y + ring)
+						visit(cell_start[row * side + x_from],
+						    cell_start[row * side + x_to + 1]);
+					else
+					{
+						if (x >= ring)
+							visit(cell_start[row * side + x - ring],
+							    cell_start[row * side + x - ring + 1]);
+						if (ring > 0 && x + ring < side)
+							visit(cell_start[row * side + x + ring],
+							    cell_start[row * side + x + ring + 1]);
+					}
+				}
+
+				/* distance to the nearest side of the visited square that
+				 * does not lie on the border */
+				float bound = INFINITY;
+				if (x_from > 0)
+					bound = std::min(bound, _x - x_from * cell_size);
+				if (x_to < side - 1)
+					bound = std::min(bound, (x_to + 1) * cell_size - _x);
+				if (y_from > 0)
+					bound = std::min(bound, _y - y_from * cell_size);
+				if (y_to < side - 1)
+					bound = std::min(bound, (y_to + 1) * cell_size - _y);
+
+				if (bound == INFINITY || best_length < bound)
+					return best;
+			}
+		}
+
+		float cell_size;
+		unsigned int side;
+
+		/* indices of cell c are indices[cell_start[c] .. cell_start[c+1]) */
+		std::vector<unsigned int> cell_start;
+		std::vector<unsigned int> indices;
+		std::vector<float> sorted_x;
+		std::vector<float> sorted_y;
+
+	private:
+		std::vector<unsigned int> cell_of;
+		std::vector<unsigned int> cursor;
+};
+
+Grid grid;
+
+Vector2
+operator+ (Vector2 const& _a, Vector2 const& _b)
+{
+	Vector2 result;
+	result.x = _a.x + _b.x;
+	result.y = _a.y + _b.y;
+
+	return result;
+}
+
+Vector2
+operator- (Vector2 const& _a, Vector2 const& _b)
+{
+	Vector2 result;
+	result.x = _a.x - _b.x;
+	result.y = _a.y - _b.y;
+
+	return result;
+}
+
+Vector2&
+operator/= (Vector2& _v, float _s)
+{
+  _v.x /= _s;
+  _v.y /= _s;
+
+  return _v;
+}
+
+Vector2&
+operator+= (Vector2 & _a, Vector2 const& _b)
 {
-	err = clGetPlatformIDs (0, NULL, &num_platforms);
-	if (num_platforms == 0)
+  _a.x += _b.x;
+  _a.y += _b.y;
+
+  return _a;
+}
+
+Vector2&
+operator-= (Vector2& _a, Vector2& _b)
+{
+  _a.x -= _b.x;
+  _a.y -= _b.y;
+
+  return _a;
+}
+
+/* Neumaier's variant of the Kahan summation. The compensation collects the
+ * low-order bits lost by each addition, so the sum stays accurate even for
+ * millions of terms of similar magnitude. */
+class Accumulator
+{
+	public:
+		Accumulator ()
+		{
+			sum = 0.0;
+			compensation = 0.0;
+		}
+
+		void
+		add (double _value)
+		{
+			double t = sum + _value;
+
+			if (fabs(sum) >= fabs(_value))
+				compensation += (sum - t) + _value;
+			else
+				compensation += (_value - t) + sum;
+
+			sum = t;
+		}
+
+		double
+		value ()
+		{
+			return sum + compensation;
+		}
+
+		double sum;
+		double compensation;
+};
+
+/* Sums of positions and velocities over the whole swarm. Rules 1 and 3 need
+ * the mean of all other mosquitoes, which is the total minus the own value,
+ * divided by N-1. */
+class Totals
+{
+	public:
+		double position_x;
+		double position_y;
+		double velocity_x;
+		double velocity_y;
+		double count;
+};
+
+Totals
+chunk_totals (SwarmState& _swarm, unsigned int _from, unsigned int _to)
+{
+	Totals totals;
+	totals.count = (double)(_to - _from);
+
+	if (compensated)
 	{
-		printf("No platforms.\n");
-		return false;
-	}
-	platforms = new cl_platform_id[num_platforms];
-	err = clGetPlatformIDs (num_platforms, platforms, NULL);
+		Accumulator position_x, position_y, velocity_x, velocity_y;
 
-	/* let the user to choose the platform */
-	printf("Select the platform: \n");
-	for (unsigned int i = 0; i < num_platforms; i++)
+		for (unsigned int i = _from; i < _to; i++)
+		{
+			position_x.add(_swarm.position_x[i]);
+			position_y.add(_swarm.position_y[i]);
+			velocity_x.add(_swarm.velocity_x[i]);
+			velocity_y.add(_swarm.velocity_y[i]);
+		}
+
+		totals.position_x = position_x.value();
+		totals.position_y = position_y.value();
+		totals.velocity_x = velocity_x.value();
+		totals.velocity_y = velocity_y.value();
+	}
+	else
 	{
-		char name[1024];
-		err = clGetPlatformInfo (platforms[i], CL_PLATFORM_NAME, 1024, &name, NULL);
-		printf("%d) %s\n", i+1, name);
+		Vector2 position;
+		Vector2 velocity;
+
+		for (unsigned int i = _from; i < _to; i++)
+		{
+			position += _swarm.position(i);
+			velocity += _swarm.velocity(i);
+		}
+
+		totals.position_x = position.x;
+		totals.position_y = position.y;
+		totals.velocity_x = velocity.x;
+		totals.velocity_y = velocity.y;
 	}
-	
-	int selected_platform;
-	scanf("%d", &selected_platform);
 
-	/* check the selection for errors */
-	if (selected_platform < 1 || selected_platform > num_platforms)
+	return totals;
+}
+
+std::vector<Totals> partial_totals;
+
+/* The totals are summed per chunk in parallel and the partial sums are then
+ * combined in the chunk order. */
+Totals
+swarm_totals (SwarmState& _swarm)
+{
+	unsigned int chunks = chunk_count(_swarm.size());
+	partial_totals.resize(chunks);
+
+	auto sum_chunk = [&] (unsigned int _chunk)
 	{
-		printf("Selection failed: not such platform number.\n");
-		return false;
+		partial_totals[_chunk] = chunk_totals(_swarm, _chunk * CHUNK_SIZE,
+		    std::min((_chunk + 1) * CHUNK_SIZE, _swarm.size()));
+	};
+	pool->parallel_for(chunks, sum_chunk);
+
+	Totals totals;
+	totals.count = (double)_swarm.size();
+
+	if (compensated)
+	{
+		Accumulator position_x, position_y, velocity_x, velocity_y;
+
+		for (auto& t : partial_totals)
+		{
+			position_x.add(t.position_x);
+			position_y.add(t.position_y);
+			velocity_x.add(t.velocity_x);
+			velocity_y.add(t.velocity_y);
+		}
+
+		totals.position_x = position_x.value();
+		totals.position_y = position_y.value();
+		totals.velocity_x = velocity_x.value();
+		totals.velocity_y = velocity_y.value();
 	}
+	else
+	{
+		Vector2 position;
+		Vector2 velocity;
 
-	platform = platforms[selected_platform-1];
-	return true;
+		for (auto& t : partial_totals)
+		{
+			position += Vector2((float)t.position_x, (float)t.position_y);
+			velocity += Vector2((float)t.velocity_x, (float)t.velocity_y);
+		}
+
+		totals.position_x = position.x;
+		totals.position_y = position.y;
+		totals.velocity_x = velocity.x;
+		totals.velocity_y = velocity.y;
+	}
+
+	return totals;
 }
 
-bool
-device_selection ()
+Vector2
+rule_1 (Vector2 _position, Totals& _totals)
+{
+	Vector2 mass_centre(
+	    (float)((_totals.position_x - _position.x) / (_totals.count - 1.0)),
+	    (float)((_totals.position_y - _position.y) / (_totals.count - 1.0)));
+
+	Vector2 direction = mass_centre - _position;	
+	direction /= rules.cohesion;
+
+	return direction;
+}
+
+Vector2
+rule_2 (unsigned int _index, SwarmState& _swarm)
 {
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, 
-	    NULL, &num_devices);
-	if (num_devices == 0)
+	Vector2 centre;
+	Vector2 position = _swarm.position(_index);
+
+	for (unsigned int j = 0; j < _swarm.size(); j++)
 	{
-		printf("No devices.\n");
-		return false;
+		if (j != _index)
+		{
+			Vector2 difference = _swarm.position(j) - position;
+			if (difference.x * difference.x + difference.y * difference.y
+			    < rules.separation * rules.separation)
+				centre -= difference;
+		}
 	}
 
-	devices = new cl_device_id[num_devices];
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 
-	    num_devices, devices, NULL);
+	return centre;
+}
+
+Vector2
+rule_2 (unsigned int _index, SwarmState& _swarm, Grid& _grid)
+{
+	Vector2 centre;
+	Vector2 position = _swarm.position(_index);
 
-	/* let the user to choose the device */
-	printf("Select the device: \n");
-	for (unsigned int i = 0; i < num_devices; i++)
+	unsigned int from[3];
+	unsigned int to[3];
+	unsigned int rows = _grid.neighbour_rows(position.x, position.y, from, to);
+
+	for (unsigned int r = 0; r < rows; r++)
 	{
-		char name[1024];
-		err = clGetDeviceInfo (devices[i], CL_DEVICE_NAME, 1024, &name, NULL);
-		printf("%d) %s\n", i+1, name);
+		for (unsigned int k = from[r]; k < to[r]; k++)
+		{
+			unsigned int j = _grid.indices[k];
+			if (j == _index)
+				continue;
+
+			Vector2 difference = _swarm.position(j) - position;
+			if (difference.x * difference.x + difference.y * difference.y
+			    < rules.separation * rules.separation)
+				centre -= difference;
+		}
 	}
 
-	int selected_device;
-	scanf("%d", &selected_device);
+	return centre;
+}
+
+/* Compare the grid and the brute-force rule 2 for the whole swarm. The sets of
+ * neighbours are identical, only the order of summation differs, therefore
+ * the results have to agree up to a relative error of 1e-4. */
+bool
+validate_rule_2 (SwarmState& _swarm, Grid& _grid)
+{
+	float max_error = 0.0f;
+
+	for (unsigned int i = 0; i < _swarm.size(); i++)
+	{
+		Vector2 expected = rule_2(i, _swarm);
+		Vector2 actual = rule_2(i, _swarm, _grid);
+		Vector2 error = expected - actual;
+
+		max_error = std::max(max_error, error.length() / (1.0f + expected.length()));
+	}
 
-	/* check the selection for errors */
-	if (selected_device < 1 || selected_device > num_devices)
+	if (max_error > 1e-4f)
 	{
-		printf("Selection failed: not such device number.\n");
+		fprintf(stderr, "Grid validation failed: relative error %g\n", max_error);
 		return false;
 	}
 
-	device = devices[selected_device-1];
 	return true;
 }
 
-bool
-init_cl ()
+Vector2
+rule_3 (Vector2 _velocity, Totals& _totals)
 {
-	context = clCreateContext(0, 1, devices, NULL, NULL, &err);
-	command_queue = clCreateCommandQueue(context, device, 0, &err);
+	Vector2 velocity(
+	    (float)((_totals.velocity_x - _velocity.x) / (_totals.count - 1.0)),
+	    (float)((_totals.velocity_y - _velocity.y) / (_totals.count - 1.0)));
 
-	return true;
+	Vector2 result;
+	result = velocity - _velocity;
+	result /= rules.alignment;
+
+	return result;
 }
 
-bool
-build_cl_program (const char* _filename)
+Vector2
+rule_4 (Vector2 _position)
 {
-	int fd = open(_filename, O_RDONLY);
-	struct stat stats;
-	fstat(fd, &stats);
+	Vector2 top_velocity;
+	Vector2 bottom_velocity;
+	Vector2 left_velocity;
+	Vector2 right_velocity;
 
-	errno = 0;
-	char* source = (char*)mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (errno != 0)
-	{
-		printf("ERROR: %s\n", strerror(errno));
-		return false;
-	}
+	if (_position.x == 0.0f || _position.y == 0.0f ||
+	    _position.x == rules.world || _position.y == rules.world)
+		return Vector2();
+
+	top_velocity.y = fabs(rules.border / _position.y);	
+	bottom_velocity.y = -fabs(rules.border / (_position.y - rules.world));	
+	left_velocity.x = fabs(rules.border / _position.x);	
+	right_velocity.x = -fabs(rules.border / (_position.x - rules.world));	
+
+	Vector2 result = top_velocity + bottom_velocity + left_velocity +
+	    right_velocity;
 
-	/* build the code */
-	program = clCreateProgramWithSource(context, 1, (const char**)&source,
-	    (const size_t*)&stats.st_size, &err);
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+	result /= rules.border_scale;
 
-	/* print the build log */
-	cl_build_status build_status;
-	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_STATUS, sizeof(cl_build_status), &build_status, NULL);
+	return result;
+}
 
-	char *build_log;
-	size_t ret_val_size;
-	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
+/* The dragonflies. A mosquito fears every dragonfly closer than fear_radius,
+ * which are found through a grid over the dragonflies with cells of at least
+ * that size. Without a radius all of them count, and the sum of the
+ * differences collapses to K times the position minus the sum of the
+ * dragonflies' positions, so the cost does not grow with K. */
+class Pack
+{
+	public:
+		Pack (unsigned int _size)
+		{
+			for (unsigned int k = 0; k < _size; k++)
+				dragonflies.push_back(Dragonfly::random(random_seed, k));
 
-	build_log = new char[ret_val_size+1];
-	err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, ret_val_size, build_log, NULL);
-	build_log[ret_val_size] = '\0';
-	printf("build log: \n %s", build_log);
+			index();
+		}
 
-	return true;
+		/* Update the sum and the grid after the dragonflies moved. */
+		void
+		index ()
+		{
+			sum = Vector2();
+			for (auto& d : dragonflies)
+				sum += d.position;
+
+			if (fear_radius <= 0.0f)
+				return;
+
+			positions.resize(dragonflies.size());
+			for (unsigned int k = 0; k < dragonflies.size(); k++)
+			{
+				positions.position_x[k] = dragonflies[k].position.x;
+				positions.position_y[k] = dragonflies[k].position.y;
+			}
+
+			float cell_size = std::max(fear_radius, rules.world / 256.0f);
+			if (grid.cell_size != cell_size)
+				grid = Grid(cell_size, rules.world);
+			grid.build(positions);
+		}
+
+		/* Sum of the differences between the position and the dragonflies
+		 * it fears. */
+		Vector2
+		fear (Vector2 _position)
+		{
+			float count = (float)dragonflies.size();
+
+			if (fear_radius <= 0.0f)
+				return Vector2(_position.x * count - sum.x,
+				    _position.y * count - sum.y);
+
+			Vector2 result;
+			unsigned int from[3];
+			unsigned int to[3];
+			unsigned int rows = grid.neighbour_rows(_position.x, _position.y,
+			    from, to);
+
+			for (unsigned int r = 0; r < rows; r++)
+			{
+				for (unsigned int k = from[r]; k < to[r]; k++)
+				{
+					Vector2 difference(_position.x - grid.sorted_x[k],
+					    _position.y - grid.sorted_y[k]);
+					if (difference.x * difference.x + difference.y * difference.y
+					    < fear_radius * fear_radius)
+						result += difference;
+				}
+			}
+
+			return result;
+		}
+
+		std::vector<Dragonfly> dragonflies;
+		Vector2 sum;
+
+	private:
+		SwarmState positions;
+		Grid grid;
+};
+
+Vector2
+rule_5 (Vector2 _position, Pack& _pack)
+{
+	Vector2 result = _pack.fear(_position);
+	result /= rules.fear;
+
+	return result;
 }
 
-bool
-extract_kernels ()
+Vector2
+hunt (Dragonfly& _d, SwarmState& _swarm)
 {
-	rule_1_kernel = clCreateKernel(program, "rule_1", &err);
-	rule_2_kernel = clCreateKernel(program, "rule_2", &err);
-	rule_3_kernel = clCreateKernel(program, "rule_3", &err);
-	rule_4_kernel = clCreateKernel(program, "rule_4", &err);
-	rule_5_kernel = clCreateKernel(program, "rule_5", &err);
-	single_step_kernel = clCreateKernel(program, "single_step", &err);
+	Vector2 closest = _d.position - _swarm.position(0);
 
-	return true;
+	for (unsigned int i = 0; i < _swarm.size(); i++)
+		if ((_d.position - _swarm.position(i)).length() < closest.length())
+			closest = (_d.position - _swarm.position(i));
+
+	closest /= -rules.chase;
+
+	return closest;
 }
 
-int 
-main (int argc, char *argv[])
+Vector2
+hunt (Dragonfly& _d, SwarmState& _swarm, Grid& _grid)
 {
-	const unsigned int N = 20;
-	std::vector<Mosquito> swarm;
-	srand(time(NULL));
+	unsigned int nearest = _grid.nearest(_d.position.x, _d.position.y);
+	Vector2 closest = _d.position - _swarm.position(nearest);
 
-	for (unsigned int i = 0; i < N; i++)
-		swarm.push_back(Mosquito::random());	
+	closest /= -rules.chase;
 
-	Dragonfly dragonfly = Dragonfly::random();
+	return closest;
+}
 
-	if (!platform_selection())
-		return 1;
+/* Write the four corners of a quad of the given half extents, centred at the
+ * position and heading along the velocity. This is the transformation of
+ * Mosquito::draw() without atan2: the rotation by the heading plus 90 degrees
+ * has the cosine -dy and the sine dx of the unit velocity. */
+void
+quad_vertices (float* _out, float _x, float _y, float _vx, float _vy,
+    float _half_width, float _half_length)
+{
+	float length = sqrtf(_vx * _vx + _vy * _vy);
+	float dx = 1.0f;
+	float dy = 0.0f;
 
-	if (!device_selection())
-		return 1;
+	if (length > 0.0f)
+	{
+		dx = _vx / length;
+		dy = _vy / length;
+	}
 
-	if (!init_cl())
-		return 1;
+	const float corners[4][2] = {
+		{-_half_width, -_half_length},
+		{ _half_width, -_half_length},
+		{ _half_width,  _half_length},
+		{-_half_width,  _half_length}};
 
-	if (!build_cl_program("source.cl"))
-		return 1;
-	
-	if(!extract_kernels())
-		return 1;
+	for (unsigned int c = 0; c < 4; c++)
+	{
+		_out[2 * c] = _x - corners[c][0] * dy - corners[c][1] * dx;
+		_out[2 * c + 1] = _y + corners[c][0] * dx - corners[c][1] * dy;
+	}
+}
+
+std::vector<float> vertices;
+
+/* Draw the whole swarm with a single glDrawArrays call. The quads are
+ * expanded into one client-side vertex array, which needs only OpenGL 1.1
+ * and therefore also works on software implementations such as Mesa. */
+void
+draw_swarm_batched (SwarmState& _swarm)
+{
+	vertices.resize(8 * _swarm.size());
+
+	auto expand = [&] (unsigned int _chunk)
+	{
+		unsigned int to = std::min((_chunk + 1) * CHUNK_SIZE, _swarm.size());
+
+		for (unsigned int i = _chunk * CHUNK_SIZE; i < to; i++)
+			quad_vertices(&vertices[8 * i], _swarm.position_x[i],
+			    _swarm.position_y[i], _swarm.velocity_x[i], _swarm.velocity_y[i],
+			    2.0f, 6.0f);
+	};
+	render_pool->parallel_for(chunk_count(_swarm.size()), expand);
+
+	glLoadIdentity();
+	glColor3ub(0, 99, 0);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, vertices.data());
+	glDrawArrays(GL_QUADS, 0, 4 * _swarm.size());
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+void
+draw_scene (SwarmState& _swarm, std::vector<Dragonfly>& _dragonflies)
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+
+	if (batched)
+		draw_swarm_batched(_swarm);
+	else
+	{
+		for (unsigned int i = 0; i < _swarm.size(); i++)
+			_swarm.get(i).draw();
+	}
+
+	for (auto& d : _dragonflies)
+		d.draw();
+}
+
+/* Per-step constants of the vector kernels. The mean of all other mosquitoes
+ * is evaluated in single precision as total/(N-1) - own/(N-1). Rule 5 is
+ * predators * position - predator; with a fear radius it differs for every
+ * mosquito and is added to rule 2 instead, and both constants are zero. */
+class Constants
+{
+	public:
+		Constants (Totals& _totals, Pack& _pack)
+		{
+			position_x = (float)(_totals.position_x / (_totals.count - 1.0));
+			position_y = (float)(_totals.position_y / (_totals.count - 1.0));
+			velocity_x = (float)(_totals.velocity_x / (_totals.count - 1.0));
+			velocity_y = (float)(_totals.velocity_y / (_totals.count - 1.0));
+			inverse = (float)(1.0 / (_totals.count - 1.0));
+			bool everyone = (fear_radius <= 0.0f);
+			predators = everyone ? (float)_pack.dragonflies.size() : 0.0f;
+			predator_x = everyone ? _pack.sum.x : 0.0f;
+			predator_y = everyone ? _pack.sum.y : 0.0f;
+		}
+
+		float position_x;
+		float position_y;
+		float velocity_x;
+		float velocity_y;
+		float inverse;
+		float predators;
+		float predator_x;
+		float predator_y;
+};
+
+/* Integration of the mosquitoes [_from, _to) with the formulas of the vector
+ * kernels, one mosquito at a time. Used for the tails of the vector loops.
+ * The rules R divide by multiplying with their reciprocals, which fold into
+ * constants for the compiled rules. */
+template <class R>
+void
+integrate_lanes (SwarmState& _current, SwarmState& _next, float* _centre_x,
+    float* _centre_y, Constants& _c, unsigned int _from, unsigned int _to)
+{
+	const float cohesion = 1.0f / R::cohesion();
+	const float alignment = 1.0f / R::alignment();
+	const float border_scale = 1.0f / R::border_scale();
+	const float fear = 1.0f / R::fear();
+	const float inertia = 1.0f / R::inertia();
+	const float slowdown = 1.0f / R::slowdown();
+	const float border = R::border();
+	const float world = R::world();
+
+	for (unsigned int i = _from; i < _to; i++)
+	{
+		float px = _current.position_x[i];
+		float py = _current.position_y[i];
+		float vx = _current.velocity_x[i];
+		float vy = _current.velocity_y[i];
+
+		float x = ((_c.position_x - px * _c.inverse) - px) * cohesion;
+		float y = ((_c.position_y - py * _c.inverse) - py) * cohesion;
+
+		x += _centre_x[i];
+		y += _centre_y[i];
+
+		x += ((_c.velocity_x - vx * _c.inverse) - vx) * alignment;
+		y += ((_c.velocity_y - vy * _c.inverse) - vy) * alignment;
+
+		if (!(px == 0.0f || py == 0.0f || px == world || py == world))
+		{
+			x += (fabsf(border / px) + -fabsf(border / (px - world))) * border_scale;
+			y += (fabsf(border / py) + -fabsf(border / (py - world))) * border_scale;
+		}
+
+		x += (px * _c.predators - _c.predator_x) * fear;
+		y += (py * _c.predators - _c.predator_y) * fear;
+
+		vx += x * inertia;
+		vy += y * inertia;
+		_next.position_x[i] = px + vx;
+		_next.position_y[i] = py + vy;
+
+		if (sqrtf(vx * vx + vy * vy) >= R::speed_limit())
+		{
+			vx *= slowdown;
+			vy *= slowdown;
+		}
+
+		_next.velocity_x[i] = vx;
+		_next.velocity_y[i] = vy;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The vector kernels below mirror integrate_lanes and the grid rule 2. Each is
+ * compiled for its own instruction set via the target attribute, so that one
+ * binary runs on every machine and select_kernels() picks the widest one the
+ * CPU supports. Neighbours are accumulated under the mask of the squared
+ * distance test; the own position has zero difference and adds nothing. */
+
+template <class R>
+__attribute__((target("sse4.2")))
+Vector2
+rule_2_sse (Grid& _grid, float _x, float _y)
+{
+	unsigned int from[3];
+	unsigned int to[3];
+	unsigned int rows = _grid.neighbour_rows(_x, _y, from, to);
+
+	__m128 x = _mm_set1_ps(_x);
+	__m128 y = _mm_set1_ps(_y);
+	__m128 radius = _mm_set1_ps(R::separation() * R::separation());
+	__m128 sum_x = _mm_setzero_ps();
+	__m128 sum_y = _mm_setzero_ps();
+	Vector2 centre;
+
+	for (unsigned int r = 0; r < rows; r++)
+	{
+		unsigned int k = from[r];
+
+		for (; k + 4 <= to[r]; k += 4)
+		{
+			__m128 dx = _mm_sub_ps(_mm_loadu_ps(&_grid.sorted_x[k]), x);
+			__m128 dy = _mm_sub_ps(_mm_loadu_ps(&_grid.sorted_y[k]), y);
+			__m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+			__m128 mask = _mm_cmplt_ps(d2, radius);
+
+			sum_x = _mm_sub_ps(sum_x, _mm_and_ps(mask, dx));
+			sum_y = _mm_sub_ps(sum_y, _mm_and_ps(mask, dy));
+		}
+
+		for (; k < to[r]; k++)
+		{
+			Vector2 difference(_grid.sorted_x[k] - _x, _grid.sorted_y[k] - _y);
+			if (difference.x * difference.x + difference.y * difference.y
+			    < R::separation() * R::separation())
+				centre -= difference;
+		}
+	}
+
+	float lanes_x[4];
+	float lanes_y[4];
+	_mm_storeu_ps(lanes_x, sum_x);
+	_mm_storeu_ps(lanes_y, sum_y);
+
+	for (unsigned int l = 0; l < 4; l++)
+		centre += Vector2(lanes_x[l], lanes_y[l]);
+
+	return centre;
+}
+
+template <class R>
+__attribute__((target("sse4.2")))
+void
+integrate_sse (SwarmState& _current, SwarmState& _next, float* _centre_x,
+    float* _centre_y, Constants& _c, unsigned int _from, unsigned int _to)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 world = _mm_set1_ps(R::world());
+	const __m128 border = _mm_set1_ps(R::border());
+	const __m128 inverse = _mm_set1_ps(_c.inverse);
+	const __m128 predators = _mm_set1_ps(_c.predators);
+	const __m128 cap = _mm_set1_ps(R::speed_limit());
+	const __m128 slowdown = _mm_set1_ps(1.0f / R::slowdown());
+	const __m128 cohesion = _mm_set1_ps(1.0f / R::cohesion());
+	const __m128 alignment = _mm_set1_ps(1.0f / R::alignment());
+	const __m128 border_scale = _mm_set1_ps(1.0f / R::border_scale());
+	const __m128 fear = _mm_set1_ps(1.0f / R::fear());
+	const __m128 inertia = _mm_set1_ps(1.0f / R::inertia());
+	const __m128 c[2][3] = {
+	    {_mm_set1_ps(_c.position_x), _mm_set1_ps(_c.velocity_x), _mm_set1_ps(_c.predator_x)},
+	    {_mm_set1_ps(_c.position_y), _mm_set1_ps(_c.velocity_y), _mm_set1_ps(_c.predator_y)}};
+
+	unsigned int i = _from;
+	for (; i + 4 <= _to; i += 4)
+	{
+		__m128 p[2] = {_mm_loadu_ps(&_current.position_x[i]), _mm_loadu_ps(&_current.position_y[i])};
+		__m128 v[2] = {_mm_loadu_ps(&_current.velocity_x[i]), _mm_loadu_ps(&_current.velocity_y[i])};
+		__m128 centre[2] = {_mm_loadu_ps(&_centre_x[i]), _mm_loadu_ps(&_centre_y[i])};
+
+		/* rule 4 does not apply to mosquitoes exactly on the border */
+		__m128 on_border = _mm_or_ps(
+		    _mm_or_ps(_mm_cmpeq_ps(p[0], zero), _mm_cmpeq_ps(p[1], zero)),
+		    _mm_or_ps(_mm_cmpeq_ps(p[0], world), _mm_cmpeq_ps(p[1], world)));
+
+		for (unsigned int d = 0; d < 2; d++)
+		{
+			__m128 change = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(c[d][0],
+			    _mm_mul_ps(p[d], inverse)), p[d]), cohesion);
+
+			change = _mm_add_ps(change, centre[d]);
+
+			change = _mm_add_ps(change, _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(c[d][1],
+			    _mm_mul_ps(v[d], inverse)), v[d]), alignment));
+
+			__m128 near = _mm_andnot_ps(sign, _mm_div_ps(border, p[d]));
+			__m128 far = _mm_or_ps(sign, _mm_div_ps(border, _mm_sub_ps(p[d], world)));
+			change = _mm_add_ps(change, _mm_andnot_ps(on_border,
+			    _mm_mul_ps(_mm_add_ps(near, far), border_scale)));
+
+			change = _mm_add_ps(change, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(p[d], predators), c[d][2]),
+			    fear));
+
+			v[d] = _mm_add_ps(v[d], _mm_mul_ps(change, inertia));
+			p[d] = _mm_add_ps(p[d], v[d]);
+		}
+
+		__m128 fast = _mm_cmpge_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(v[0], v[0]),
+		    _mm_mul_ps(v[1], v[1]))), cap);
+		v[0] = _mm_blendv_ps(v[0], _mm_mul_ps(v[0], slowdown), fast);
+		v[1] = _mm_blendv_ps(v[1], _mm_mul_ps(v[1], slowdown), fast);
+
+		_mm_storeu_ps(&_next.position_x[i], p[0]);
+		_mm_storeu_ps(&_next.position_y[i], p[1]);
+		_mm_storeu_ps(&_next.velocity_x[i], v[0]);
+		_mm_storeu_ps(&_next.velocity_y[i], v[1]);
+	}
+
+	integrate_lanes<R>(_current, _next, _centre_x, _centre_y, _c, i, _to);
+}
+
+template <class R>
+__attribute__((target("avx2")))
+Vector2
+rule_2_avx2 (Grid& _grid, float _x, float _y)
+{
+	unsigned int from[3];
+	unsigned int to[3];
+	unsigned int rows = _grid.neighbour_rows(_x, _y, from, to);
+
+	__m256 x = _mm256_set1_ps(_x);
+	__m256 y = _mm256_set1_ps(_y);
+	__m256 radius = _mm256_set1_ps(R::separation() * R::separation());
+	__m256 sum_x = _mm256_setzero_ps();
+	__m256 sum_y = _mm256_setzero_ps();
+	Vector2 centre;
+
+	for (unsigned int r = 0; r < rows; r++)
+	{
+		unsigned int k = from[r];
+
+		for (; k + 8 <= to[r]; k += 8)
+		{
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&_grid.sorted_x[k]), x);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&_grid.sorted_y[k]), y);
+			__m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+			__m256 mask = _mm256_cmp_ps(d2, radius, _CMP_LT_OQ);
+
+			sum_x = _mm256_sub_ps(sum_x, _mm256_and_ps(mask, dx));
+			sum_y = _mm256_sub_ps(sum_y, _mm256_and_ps(mask, dy));
+		}
+
+		for (; k < to[r]; k++)
+		{
+			Vector2 difference(_grid.sorted_x[k] - _x, _grid.sorted_y[k] - _y);
+			if (difference.x * difference.x + difference.y * difference.y
+			    < R::separation() * R::separation())
+				centre -= difference;
+		}
+	}
+
+	float lanes_x[8];
+	float lanes_y[8];
+	_mm256_storeu_ps(lanes_x, sum_x);
+	_mm256_storeu_ps(lanes_y, sum_y);
+
+	for (unsigned int l = 0; l < 8; l++)
+		centre += Vector2(lanes_x[l], lanes_y[l]);
+
+	return centre;
+}
+
+template <class R>
+__attribute__((target("avx2")))
+void
+integrate_avx2 (SwarmState& _current, SwarmState& _next, float* _centre_x,
+    float* _centre_y, Constants& _c, unsigned int _from, unsigned int _to)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 world = _mm256_set1_ps(R::world());
+	const __m256 border = _mm256_set1_ps(R::border());
+	const __m256 inverse = _mm256_set1_ps(_c.inverse);
+	const __m256 predators = _mm256_set1_ps(_c.predators);
+	const __m256 cap = _mm256_set1_ps(R::speed_limit());
+	const __m256 slowdown = _mm256_set1_ps(1.0f / R::slowdown());
+	const __m256 cohesion = _mm256_set1_ps(1.0f / R::cohesion());
+	const __m256 alignment = _mm256_set1_ps(1.0f / R::alignment());
+	const __m256 border_scale = _mm256_set1_ps(1.0f / R::border_scale());
+	const __m256 fear = _mm256_set1_ps(1.0f / R::fear());
+	const __m256 inertia = _mm256_set1_ps(1.0f / R::inertia());
+	const __m256 c[2][3] = {
+	    {_mm256_set1_ps(_c.position_x), _mm256_set1_ps(_c.velocity_x), _mm256_set1_ps(_c.predator_x)},
+	    {_mm256_set1_ps(_c.position_y), _mm256_set1_ps(_c.velocity_y), _mm256_set1_ps(_c.predator_y)}};
+
+	unsigned int i = _from;
+	for (; i + 8 <= _to; i += 8)
+	{
+		__m256 p[2] = {_mm256_loadu_ps(&_current.position_x[i]), _mm256_loadu_ps(&_current.position_y[i])};
+		__m256 v[2] = {_mm256_loadu_ps(&_current.velocity_x[i]), _mm256_loadu_ps(&_current.velocity_y[i])};
+		__m256 centre[2] = {_mm256_loadu_ps(&_centre_x[i]), _mm256_loadu_ps(&_centre_y[i])};
+
+		/* rule 4 does not apply to mosquitoes exactly on the border */
+		__m256 on_border = _mm256_or_ps(
+		    _mm256_or_ps(_mm256_cmp_ps(p[0], zero, _CMP_EQ_OQ), _mm256_cmp_ps(p[1], zero, _CMP_EQ_OQ)),
+		    _mm256_or_ps(_mm256_cmp_ps(p[0], world, _CMP_EQ_OQ), _mm256_cmp_ps(p[1], world, _CMP_EQ_OQ)));
+
+		for (unsigned int d = 0; d < 2; d++)
+		{
+			__m256 change = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(c[d][0],
+			    _mm256_mul_ps(p[d], inverse)), p[d]), cohesion);
+
+			change = _mm256_add_ps(change, centre[d]);
+
+			change = _mm256_add_ps(change, _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(c[d][1],
+			    _mm256_mul_ps(v[d], inverse)), v[d]), alignment));
+
+			__m256 near = _mm256_andnot_ps(sign, _mm256_div_ps(border, p[d]));
+			__m256 far = _mm256_or_ps(sign, _mm256_div_ps(border, _mm256_sub_ps(p[d], world)));
+			change = _mm256_add_ps(change, _mm256_andnot_ps(on_border,
+			    _mm256_mul_ps(_mm256_add_ps(near, far), border_scale)));
+
+			change = _mm256_add_ps(change, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(p[d], predators), c[d][2]),
+			    fear));
+
+			v[d] = _mm256_add_ps(v[d], _mm256_mul_ps(change, inertia));
+			p[d] = _mm256_add_ps(p[d], v[d]);
+		}
+
+		__m256 fast = _mm256_cmp_ps(_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(v[0], v[0]),
+		    _mm256_mul_ps(v[1], v[1]))), cap, _CMP_GE_OQ);
+		v[0] = _mm256_blendv_ps(v[0], _mm256_mul_ps(v[0], slowdown), fast);
+		v[1] = _mm256_blendv_ps(v[1], _mm256_mul_ps(v[1], slowdown), fast);
+
+		_mm256_storeu_ps(&_next.position_x[i], p[0]);
+		_mm256_storeu_ps(&_next.position_y[i], p[1]);
+		_mm256_storeu_ps(&_next.velocity_x[i], v[0]);
+		_mm256_storeu_ps(&_next.velocity_y[i], v[1]);
+	}
+
+	integrate_lanes<R>(_current, _next, _centre_x, _centre_y, _c, i, _to);
+}
+
+template <class R>
+__attribute__((target("avx512f")))
+Vector2
+rule_2_avx512 (Grid& _grid, float _x, float _y)
+{
+	unsigned int from[3];
+	unsigned int to[3];
+	unsigned int rows = _grid.neighbour_rows(_x, _y, from, to);
+
+	__m512 x = _mm512_set1_ps(_x);
+	__m512 y = _mm512_set1_ps(_y);
+	__m512 radius = _mm512_set1_ps(R::separation() * R::separation());
+	__m512 sum_x = _mm512_setzero_ps();
+	__m512 sum_y = _mm512_setzero_ps();
+
+	for (unsigned int r = 0; r < rows; r++)
+	{
+		for (unsigned int k = from[r]; k < to[r]; k += 16)
+		{
+			/* the tail of the range is loaded under a mask */
+			__mmask16 valid = (to[r] - k >= 16) ? 0xFFFF
+			    : (__mmask16)((1u << (to[r] - k)) - 1);
+
+			__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, &_grid.sorted_x[k]), x);
+			__m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, &_grid.sorted_y[k]), y);
+			__m512 d2 = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+			__mmask16 mask = _mm512_mask_cmp_ps_mask(valid, d2, radius, _CMP_LT_OQ);
+
+			sum_x = _mm512_mask_sub_ps(sum_x, mask, sum_x, dx);
+			sum_y = _mm512_mask_sub_ps(sum_y, mask, sum_y, dy);
+		}
+	}
+
+	return Vector2(_mm512_reduce_add_ps(sum_x), _mm512_reduce_add_ps(sum_y));
+}
+
+template <class R>
+__attribute__((target("avx512f")))
+void
+integrate_avx512 (SwarmState& _current, SwarmState& _next, float* _centre_x,
+    float* _centre_y, Constants& _c, unsigned int _from, unsigned int _to)
+{
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 world = _mm512_set1_ps(R::world());
+	const __m512 border = _mm512_set1_ps(R::border());
+	const __m512 inverse = _mm512_set1_ps(_c.inverse);
+	const __m512 predators = _mm512_set1_ps(_c.predators);
+	const __m512 cap = _mm512_set1_ps(R::speed_limit());
+	const __m512 slowdown = _mm512_set1_ps(1.0f / R::slowdown());
+	const __m512 cohesion = _mm512_set1_ps(1.0f / R::cohesion());
+	const __m512 alignment = _mm512_set1_ps(1.0f / R::alignment());
+	const __m512 border_scale = _mm512_set1_ps(1.0f / R::border_scale());
+	const __m512 fear = _mm512_set1_ps(1.0f / R::fear());
+	const __m512 inertia = _mm512_set1_ps(1.0f / R::inertia());
+	const __m512 c[2][3] = {
+	    {_mm512_set1_ps(_c.position_x), _mm512_set1_ps(_c.velocity_x), _mm512_set1_ps(_c.predator_x)},
+	    {_mm512_set1_ps(_c.position_y), _mm512_set1_ps(_c.velocity_y), _mm512_set1_ps(_c.predator_y)}};
+
+	unsigned int i = _from;
+	for (; i + 16 <= _to; i += 16)
+	{
+		__m512 p[2] = {_mm512_loadu_ps(&_current.position_x[i]), _mm512_loadu_ps(&_current.position_y[i])};
+		__m512 v[2] = {_mm512_loadu_ps(&_current.velocity_x[i]), _mm512_loadu_ps(&_current.velocity_y[i])};
+		__m512 centre[2] = {_mm512_loadu_ps(&_centre_x[i]), _mm512_loadu_ps(&_centre_y[i])};
+
+		/* rule 4 does not apply to mosquitoes exactly on the border */
+		__mmask16 inside = ~(_mm512_cmp_ps_mask(p[0], zero, _CMP_EQ_OQ)
+		    | _mm512_cmp_ps_mask(p[1], zero, _CMP_EQ_OQ)
+		    | _mm512_cmp_ps_mask(p[0], world, _CMP_EQ_OQ)
+		    | _mm512_cmp_ps_mask(p[1], world, _CMP_EQ_OQ));
+
+		for (unsigned int d = 0; d < 2; d++)
+		{
+			__m512 change = _mm512_mul_ps(_mm512_sub_ps(_mm512_sub_ps(c[d][0],
+			    _mm512_mul_ps(p[d], inverse)), p[d]), cohesion);
+
+			change = _mm512_add_ps(change, centre[d]);
+
+			change = _mm512_add_ps(change, _mm512_mul_ps(_mm512_sub_ps(_mm512_sub_ps(c[d][1],
+			    _mm512_mul_ps(v[d], inverse)), v[d]), alignment));
+
+			__m512 near = _mm512_abs_ps(_mm512_div_ps(border, p[d]));
+			__m512 far = _mm512_sub_ps(zero, _mm512_abs_ps(_mm512_div_ps(border,
+			    _mm512_sub_ps(p[d], world))));
+			change = _mm512_mask_add_ps(change, inside, change,
+			    _mm512_mul_ps(_mm512_add_ps(near, far), border_scale));
+
+			change = _mm512_add_ps(change, _mm512_mul_ps(_mm512_sub_ps(_mm512_mul_ps(p[d], predators), c[d][2]),
+			    fear));
+
+			v[d] = _mm512_add_ps(v[d], _mm512_mul_ps(change, inertia));
+			p[d] = _mm512_add_ps(p[d], v[d]);
+		}
+
+		__mmask16 fast = _mm512_cmp_ps_mask(_mm512_sqrt_ps(_mm512_add_ps(
+		    _mm512_mul_ps(v[0], v[0]), _mm512_mul_ps(v[1], v[1]))), cap, _CMP_GE_OQ);
+		v[0] = _mm512_mask_mul_ps(v[0], fast, v[0], slowdown);
+		v[1] = _mm512_mask_mul_ps(v[1], fast, v[1], slowdown);
+
+		_mm512_storeu_ps(&_next.position_x[i], p[0]);
+		_mm512_storeu_ps(&_next.position_y[i], p[1]);
+		_mm512_storeu_ps(&_next.velocity_x[i], v[0]);
+		_mm512_storeu_ps(&_next.velocity_y[i], v[1]);
+	}
+
+	integrate_lanes<R>(_current, _next, _centre_x, _centre_y, _c, i, _to);
+}
+
+#endif
+
+/* Implementations of the step, from the narrowest to the widest. The scalar
+ * entry has no kernels and runs the reference rules in step_scalar(). Every
+ * vector entry has the kernels for the compiled rules and the generic ones
+ * that read the rules at run time. */
+class Kernels
+{
+	public:
+		const char* name;
+		const char* feature;
+		Vector2 (*rule_2)(Grid&, float, float);
+		void (*integrate)(SwarmState&, SwarmState&, float*, float*, Constants&,
+		    unsigned int, unsigned int);
+		Vector2 (*generic_rule_2)(Grid&, float, float);
+		void (*generic_integrate)(SwarmState&, SwarmState&, float*, float*,
+		    Constants&, unsigned int, unsigned int);
+};
+
+Kernels kernels[] = {
+	{"scalar", NULL, NULL, NULL, NULL, NULL},
+#if defined(__x86_64__) || defined(__i386__)
+	{"sse4.2", "sse4.2", rule_2_sse<CompiledRules>,
+	    integrate_sse<CompiledRules>, rule_2_sse<RuntimeRules>,
+	    integrate_sse<RuntimeRules>},
+	{"avx2", "avx2", rule_2_avx2<CompiledRules>,
+	    integrate_avx2<CompiledRules>, rule_2_avx2<RuntimeRules>,
+	    integrate_avx2<RuntimeRules>},
+	{"avx512", "avx512f", rule_2_avx512<CompiledRules>,
+	    integrate_avx512<CompiledRules>, rule_2_avx512<RuntimeRules>,
+	    integrate_avx512<RuntimeRules>},
+#endif
+};
+const unsigned int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+Kernels* selected_kernels = &kernels[0];
+
+bool
+kernels_supported (Kernels& _kernels)
+{
+	if (_kernels.feature == NULL)
+		return true;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (strcmp(_kernels.feature, "sse4.2") == 0)
+		return __builtin_cpu_supports("sse4.2");
+	if (strcmp(_kernels.feature, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(_kernels.feature, "avx512f") == 0)
+		return __builtin_cpu_supports("avx512f");
+#endif
+
+	return false;
+}
+
+/* Select the kernels by name, or the widest supported by the CPU if the name
+ * is NULL. */
+bool
+select_kernels (const char* _name)
+{
+	for (unsigned int i = 0; i < num_kernels; i++)
+	{
+		if (_name != NULL && strcmp(kernels[i].name, _name) != 0)
+			continue;
+
+		if (!kernels_supported(kernels[i]))
+		{
+			if (_name != NULL)
+			{
+				printf("The CPU does not support %s.\n", _name);
+				return false;
+			}
+			continue;
+		}
+
+		selected_kernels = &kernels[i];
+	}
+
+	if (_name != NULL && strcmp(selected_kernels->name, _name) != 0)
+	{
+		printf("Unknown instruction set: %s\n", _name);
+		return false;
+	}
+
+	return true;
+}
+
+std::vector<float> centre_x;
+std::vector<float> centre_y;
+SwarmState reference;
+
+/* The reference implementation of the rules, one mosquito at a time. */
+void
+step_scalar (SwarmState& _current, SwarmState& _next, Totals& _totals,
+    Pack& _pack, unsigned int _from, unsigned int _to)
+{
+	for (unsigned int i = _from; i < _to; i++)
+	{
+		Vector2 position = _current.position(i);
+		Vector2 velocity = _current.velocity(i);
+
+		Vector2 v1 = rule_1(position, _totals);
+		Vector2 v2 = brute_force ? rule_2(i, _current) : rule_2(i, _current, grid);
+		Vector2 v3 = rule_3(velocity, _totals);
+		Vector2 v4 = rule_4(position);
+		Vector2 v5 = rule_5(position, _pack);
+
+		Vector2 change;
+		change += v1;
+		change += v2;
+		change += v3;
+		change += v4;
+		change += v5;
+
+		change /= rules.inertia;
+
+		Mosquito new_mosquito;
+		new_mosquito.velocity = velocity + change;
+		new_mosquito.position = position + new_mosquito.velocity;
+
+		if (new_mosquito.velocity.length() >= rules.speed_limit)
+			new_mosquito.velocity /= rules.slowdown;
+
+		_next.set(i, new_mosquito);
+	}
+}
+
+void
+step_vector (SwarmState& _current, SwarmState& _next, Constants& _constants,
+    Pack& _pack, unsigned int _from, unsigned int _to)
+{
+	auto rule_2 = specialised ? selected_kernels->rule_2
+	    : selected_kernels->generic_rule_2;
+
+	for (unsigned int i = _from; i < _to; i++)
+	{
+		Vector2 centre = rule_2(grid, _current.position_x[i],
+		    _current.position_y[i]);
+
+		/* the fear within a radius differs for every mosquito */
+		if (fear_radius > 0.0f)
+			centre += rule_5(_current.position(i), _pack);
+
+		centre_x[i] = centre.x;
+		centre_y[i] = centre.y;
+	}
+
+	auto integrate = specialised ? selected_kernels->integrate
+	    : selected_kernels->generic_integrate;
+	integrate(_current, _next, centre_x.data(), centre_y.data(), _constants,
+	    _from, _to);
+}
+
+/* Compare the vector step with the scalar reference. The vector kernels sum
+ * the neighbours in a different order and compute the means of rules 1 and 3
+ * in single precision; the new states have to agree up to a relative error of
+ * 1e-4. */
+bool
+validate_step (SwarmState& _current, SwarmState& _next, Totals& _totals,
+    Pack& _pack)
+{
+	float max_error = 0.0f;
+
+	reference.resize(_current.size());
+	step_scalar(_current, reference, _totals, _pack, 0, _current.size());
+
+	for (unsigned int i = 0; i < _current.size(); i++)
+	{
+		Vector2 position_error = _next.position(i) - reference.position(i);
+		Vector2 velocity_error = _next.velocity(i) - reference.velocity(i);
+
+		max_error = std::max(max_error, position_error.length()
+		    / (1.0f + reference.position(i).length()));
+		max_error = std::max(max_error, velocity_error.length()
+		    / (1.0f + reference.velocity(i).length()));
+	}
+
+	if (max_error > 1e-4f)
+	{
+		fprintf(stderr, "%s validation failed: relative error %g\n",
+		    selected_kernels->name, max_error);
+		return false;
+	}
+
+	return true;
+}
+
+void
+step (Swarm& _swarm, Pack& _pack)
+{
+	SwarmState& current = _swarm.front();
+	SwarmState& next = _swarm.back();
+	Totals totals = swarm_totals(current);
+
+	if (!brute_force || validate)
+		grid.build(current);
+
+	if (validate && !validate_rule_2(current, grid))
+		exit(1);
+
+	unsigned int size = current.size();
+	bool vector = !brute_force && selected_kernels->integrate != NULL;
+	Constants constants(totals, _pack);
+
+	centre_x.resize(size);
+	centre_y.resize(size);
+
+	/* every mosquito only reads the current state, so the chunks are
+	 * independent */
+	auto step_chunk = [&] (unsigned int _chunk)
+	{
+		unsigned int from = _chunk * CHUNK_SIZE;
+		unsigned int to = std::min(from + CHUNK_SIZE, size);
+
+		if (vector)
+			step_vector(current, next, constants, _pack, from, to);
+		else
+			step_scalar(current, next, totals, _pack, from, to);
+	};
+	pool->parallel_for(chunk_count(size), step_chunk);
+
+	if (vector && validate && !validate_step(current, next, totals, _pack))
+		exit(1);
+
+	_swarm.swap();
+}
+
+/* Grid over the swarm for the hunt, with cells small enough to hold only a
+ * few mosquitoes, so that the nearest one is found in a few cells. */
+Grid prey_grid;
+
+void
+move_predators (Pack& _pack, SwarmState& _swarm)
+{
+	if (!brute_force || validate)
+	{
+		float cell_size = std::max(rules.world / sqrtf(_swarm.size() / 2.0f),
+		    rules.world / 1024.0f);
+		if (prey_grid.cell_size != cell_size)
+			prey_grid = Grid(cell_size, rules.world);
+		prey_grid.build(_swarm);
+	}
+
+	for (auto& d : _pack.dragonflies)
+	{
+		Vector2 acceleration = brute_force ? hunt(d, _swarm)
+		    : hunt(d, _swarm, prey_grid);
+
+		/* both searches have to find the same mosquito */
+		if (validate)
+		{
+			Vector2 expected = brute_force ? hunt(d, _swarm, prey_grid)
+			    : hunt(d, _swarm);
+			if (expected.x != acceleration.x || expected.y != acceleration.y)
+			{
+				fprintf(stderr, "Hunt validation failed: (%g, %g) instead of "
+				    "(%g, %g)\n", acceleration.x, acceleration.y, expected.x,
+				    expected.y);
+				exit(1);
+			}
+		}
+
+		d.velocity += acceleration;
+		if (d.velocity.length() >= rules.predator_speed_limit)
+			d.velocity /= rules.slowdown;
+		d.position += d.velocity;
+	}
+
+	_pack.index();
+}
+
+/* FNV-1a hash of the bit patterns of the swarm and the predators. */
+uint64_t
+checksum (SwarmState& _swarm, Pack& _pack)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	auto add = [&] (float _value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &_value, sizeof(bits));
+
+		for (unsigned int b = 0; b < 4; b++)
+		{
+			hash ^= (bits >> (8 * b)) & 0xFF;
+			hash *= 1099511628211ull;
+		}
+	};
+
+	for (unsigned int i = 0; i < _swarm.size(); i++)
+	{
+		add(_swarm.position_x[i]);
+		add(_swarm.position_y[i]);
+		add(_swarm.velocity_x[i]);
+		add(_swarm.velocity_y[i]);
+	}
+
+	for (auto& d : _pack.dragonflies)
+	{
+		add(d.position.x);
+		add(d.position.y);
+		add(d.velocity.x);
+		add(d.velocity.y);
+	}
+
+	return hash;
+}
+
+/* Fill the swarm with random mosquitoes, in parallel. */
+void
+random_swarm (SwarmState& _swarm, uint32_t _seed)
+{
+	auto fill = [&] (unsigned int _chunk)
+	{
+		unsigned int to = std::min((_chunk + 1) * CHUNK_SIZE, _swarm.size());
+
+		for (unsigned int i = _chunk * CHUNK_SIZE; i < to; i++)
+		{
+			Mosquito m = Mosquito::random(_seed, i);
+			_swarm.set(i, m);
+		}
+	};
+
+	pool->parallel_for(chunk_count(_swarm.size()), fill);
+}
+
+/* Trajectory files start with this fixed-size header, followed by one frame
+ * per recorded step: a FrameHeader and its payload. The payload has the
+ * position x, position y, velocity x and velocity y of the mosquitoes and then
+ * of the dragonflies, one component after the other. Values are floats, or
+ * with TRAJECTORY_QUANTISED 16-bit fractions of the position and velocity
+ * extents. Key frames store the values as they are; with TRAJECTORY_DELTA the
+ * frames in between store varints of the difference to the previous frame,
+ * the XOR of the bit patterns for floats and the zigzag-coded wrapping
+ * difference for quantised values. The byte order is the host's.
+ *
+ * Closing the recorder appends the key frame index, a FRAME_INDEX record whose
+ * payload is the number of frames and the file offset of every key frame, all
+ * 64-bit, and then a TrajectoryFooter pointing at the index. */
+const char TRAJECTORY_MAGIC[8] = {'K', 'O', 'M', 'A', 'R', 'N', 'O', 'T'};
+const char TRAJECTORY_INDEX_MAGIC[8] = {'K', 'O', 'M', 'A', 'R', 'N', 'O', 'I'};
+const uint32_t TRAJECTORY_VERSION = 1;
+const uint32_t TRAJECTORY_QUANTISED = 1;
+const uint32_t TRAJECTORY_DELTA = 2;
+const uint32_t FRAME_KEY = 1;
+const uint32_t FRAME_INDEX = 2;
+
+class TrajectoryHeader
+{
+	public:
+		char magic[8];
+		uint32_t version;
+		uint32_t flags;
+		uint32_t swarm_size;
+		uint32_t predators;
+		uint32_t keyframe_interval;
+		float position_extent;
+		float velocity_extent;
+		uint32_t reserved[7];
+};
+
+class FrameHeader
+{
+	public:
+		uint32_t step;
+		uint32_t flags;
+		uint64_t size;
+};
+
+class TrajectoryFooter
+{
+	public:
+		uint64_t index_offset;
+		char magic[8];
+};
+
+static_assert(sizeof(TrajectoryHeader) == 64, "trajectory header layout");
+static_assert(sizeof(FrameHeader) == 16, "frame header layout");
+static_assert(sizeof(TrajectoryFooter) == 16, "trajectory footer layout");
+
+/* Map a value in [_low, _high] to 16 bits, clamping values outside. */
+uint16_t
+quantise (float _value, float _low, float _high)
+{
+	float q = (_value - _low) / (_high - _low) * 65535.0f;
+
+	if (!(q >= 0.0f))
+		return 0;
+	if (q >= 65535.0f)
+		return 65535;
+
+	return (uint16_t)lrintf(q);
+}
+
+void
+put_varint (std::vector<uint8_t>& _out, uint32_t _value)
+{
+	while (_value >= 0x80)
+	{
+		_out.push_back((uint8_t)(_value | 0x80));
+		_value >>= 7;
+	}
+	_out.push_back((uint8_t)_value);
+}
+
+bool
+get_varint (const uint8_t*& _in, const uint8_t* _end, uint32_t& _value)
+{
+	_value = 0;
+	for (unsigned int shift = 0; shift < 35; shift += 7)
+	{
+		if (_in == _end)
+			return false;
+
+		uint8_t byte = *_in++;
+		_value |= (uint32_t)(byte & 0x7f) << shift;
+		if (byte < 0x80)
+			return true;
+	}
+
+	return false;
+}
+
+/* Streams the states of a run into a trajectory file. record() only copies
+ * the state into a free frame and queues it; a background thread encodes and
+ * writes the queued frames. The queue holds up to QUEUE_BYTES of frames, but
+ * at least QUEUE_FRAMES. When the disk cannot keep up and the queue is full,
+ * the state is dropped instead of blocking the step, and the gap shows in the
+ * step numbers of the file. */
+class Recorder
+{
+	public:
+		static const unsigned int QUEUE_FRAMES = 8;
+		static const size_t QUEUE_BYTES = 64 << 20;
+		static const unsigned int KEYFRAME_INTERVAL = 64;
+
+		Recorder ()
+		{
+			file = NULL;
+		}
+
+		bool
+		open (const char* _path, unsigned int _swarm_size, unsigned int _predators,
+		    bool _quantised, bool _delta, uint32_t _first_step)
+		{
+			file = fopen(_path, "wb");
+			if (file == NULL)
+			{
+				printf("Unable to create %s: %s\n", _path, strerror(errno));
+				return false;
+			}
+			setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+			header.version = TRAJECTORY_VERSION;
+			header.flags = (_quantised ? TRAJECTORY_QUANTISED : 0)
+			    | (_delta ? TRAJECTORY_DELTA : 0);
+			header.swarm_size = _swarm_size;
+			header.predators = _predators;
+			header.keyframe_interval = _delta ? KEYFRAME_INTERVAL : 1;
+			header.position_extent = rules.world;
+			header.velocity_extent = 1.0f;
+			fwrite(&header, sizeof(header), 1, file);
+			bytes = sizeof(header);
+
+			values = 4 * (_swarm_size + _predators);
+			capacity = std::max((size_t)QUEUE_FRAMES,
+			    QUEUE_BYTES / (values * sizeof(float)));
+			previous.resize(values);
+
+			steps = _first_step;
+			written = 0;
+			dropped = 0;
+			recording = 0.0;
+			stop = false;
+			writer = std::thread(&Recorder::write_frames, this);
+
+			return true;
+		}
+
+		/* Queue the state of the next step. Called by the stepping thread. */
+		void
+		record (SwarmState& _swarm, std::vector<Dragonfly>& _dragonflies)
+		{
+			auto start = std::chrono::steady_clock::now();
+			Frame* frame = NULL;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!free_frames.empty())
+				{
+					frame = free_frames.back();
+					free_frames.pop_back();
+				}
+			}
+
+			/* the frames are allocated as the queue grows */
+			if (frame == NULL && frames.size() < capacity)
+			{
+				frames.emplace_back();
+				frame = &frames.back();
+				frame->values.resize(values);
+			}
+
+			if (frame == NULL)
+				dropped++;
+			else
+			{
+				unsigned int n = _swarm.size();
+				unsigned int agents = n + _dragonflies.size();
+				float* v = frame->values.data();
+
+				std::copy(_swarm.position_x.begin(), _swarm.position_x.end(), v);
+				std::copy(_swarm.position_y.begin(), _swarm.position_y.end(), v + agents);
+				std::copy(_swarm.velocity_x.begin(), _swarm.velocity_x.end(), v + 2 * agents);
+				std::copy(_swarm.velocity_y.begin(), _swarm.velocity_y.end(), v + 3 * agents);
+				for (unsigned int k = 0; k < _dragonflies.size(); k++)
+				{
+					v[n + k] = _dragonflies[k].position.x;
+					v[agents + n + k] = _dragonflies[k].position.y;
+					v[2 * agents + n + k] = _dragonflies[k].velocity.x;
+					v[3 * agents + n + k] = _dragonflies[k].velocity.y;
+				}
+				frame->step = steps;
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					queue.push_back(frame);
+				}
+				ready.notify_one();
+			}
+
+			steps++;
+			recording += std::chrono::duration<double>(
+			    std::chrono::steady_clock::now() - start).count();
+		}
+
+		/* Write the remaining frames, close the file and report the size and
+		 * the time the stepping thread spent in record(). */
+		void
+		close ()
+		{
+			if (file == NULL)
+				return;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			ready.notify_one();
+			writer.join();
+
+			write_index();
+			fclose(file);
+			file = NULL;
+
+			double agent_steps = (double)written
+			    * (header.swarm_size + header.predators);
+			printf("recorded frames: %llu (%llu dropped)\n",
+			    (unsigned long long)written, (unsigned long long)dropped);
+			printf("recorded bytes per agent-step: %.3f\n",
+			    agent_steps > 0 ? bytes / agent_steps : 0.0);
+			printf("recording ns per agent-step: %.2f\n",
+			    steps > 0 ? recording * 1e9 / ((double)steps
+			    * (header.swarm_size + header.predators)) : 0.0);
+		}
+
+		/* seconds the stepping thread spent in record() */
+		double recording;
+
+	private:
+		class Frame
+		{
+			public:
+				uint32_t step;
+				std::vector<float> values;
+		};
+
+		void
+		write_frames ()
+		{
+			while (true)
+			{
+				Frame* frame;
+
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					ready.wait(lock, [this] { return stop || !queue.empty(); });
+					if (queue.empty())
+						return;
+
+					frame = queue.front();
+					queue.pop_front();
+				}
+
+				encode(*frame);
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					free_frames.push_back(frame);
+				}
+			}
+		}
+
+		void
+		encode (Frame& _frame)
+		{
+			bool quantised = header.flags & TRAJECTORY_QUANTISED;
+			bool key = (written % header.keyframe_interval) == 0;
+			unsigned int agents = header.swarm_size + header.predators;
+
+			payload.clear();
+			for (unsigned int i = 0; i < _frame.values.size(); i++)
+			{
+				uint32_t value;
+				if (!quantised)
+					memcpy(&value, &_frame.values[i], sizeof(value));
+				else if (i < 2 * agents)
+					value = quantise(_frame.values[i], 0.0f, header.position_extent);
+				else
+					value = quantise(_frame.values[i], -header.velocity_extent,
+					    header.velocity_extent);
+
+				if (key && quantised)
+				{
+					uint16_t q = value;
+					payload.insert(payload.end(), (uint8_t*)&q, (uint8_t*)&q + 2);
+				}
+				else if (key)
+					payload.insert(payload.end(), (uint8_t*)&value, (uint8_t*)&value + 4);
+				else if (quantised)
+				{
+					int16_t difference = (int16_t)(uint16_t)(value - previous[i]);
+					put_varint(payload, (uint16_t)((difference << 1) ^ (difference >> 15)));
+				}
+				else
+					put_varint(payload, value ^ previous[i]);
+
+				previous[i] = value;
+			}
+
+			FrameHeader frame_header;
+			frame_header.step = _frame.step;
+			frame_header.flags = key ? FRAME_KEY : 0;
+			frame_header.size = payload.size();
+
+			if (key)
+				keyframes.push_back(bytes);
+			fwrite(&frame_header, sizeof(frame_header), 1, file);
+			fwrite(payload.data(), 1, payload.size(), file);
+			bytes += sizeof(frame_header) + payload.size();
+			written++;
+		}
+
+		void
+		write_index ()
+		{
+			FrameHeader frame_header;
+			frame_header.step = 0;
+			frame_header.flags = FRAME_INDEX;
+			frame_header.size = (1 + keyframes.size()) * sizeof(uint64_t);
+
+			TrajectoryFooter footer;
+			footer.index_offset = bytes;
+			memcpy(footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(footer.magic));
+
+			fwrite(&frame_header, sizeof(frame_header), 1, file);
+			fwrite(&written, sizeof(written), 1, file);
+			fwrite(keyframes.data(), sizeof(uint64_t), keyframes.size(), file);
+			fwrite(&footer, sizeof(footer), 1, file);
+			bytes += sizeof(frame_header) + frame_header.size + sizeof(footer);
+		}
+
+		FILE* file;
+		TrajectoryHeader header;
+		unsigned int values;
+
+		/* every frame is in free_frames, in queue, or with one of the
+		 * threads; frames only grows, by the stepping thread */
+		std::deque<Frame> frames;
+		size_t capacity;
+		std::vector<Frame*> free_frames;
+		std::deque<Frame*> queue;
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::thread writer;
+		bool stop;
+
+		/* used by the writer thread only */
+		std::vector<uint32_t> previous;
+		std::vector<uint8_t> payload;
+		uint64_t bytes;
+		uint64_t written;
+		std::vector<uint64_t> keyframes;
+
+		/* used by the stepping thread only */
+		uint32_t steps;
+		uint64_t dropped;
+};
+
+/* --record writes the trajectory of the run, NULL records nothing */
+Recorder* recorder = NULL;
+
+/* Reads a trajectory file through a memory map, so only the pages of the
+ * frames that are shown are read from disk. seek() finds the key frame before
+ * the wanted frame in the index and decodes at most keyframe_interval - 1
+ * delta frames from there, or continues from the last decoded frame when the
+ * wanted frame follows it. Files without an index, from runs that never
+ * closed the recorder, are scanned once to build it. */
+class Player
+{
+	public:
+		Player ()
+		{
+			data = NULL;
+			length = 0;
+		}
+
+		~Player ()
+		{
+			if (data != NULL)
+				munmap((void*)data, length);
+		}
+
+		bool
+		open (const char* _path)
+		{
+			int fd = ::open(_path, O_RDONLY);
+			if (fd < 0)
+			{
+				printf("Unable to open %s: %s\n", _path, strerror(errno));
+				return false;
+			}
+
+			struct stat info;
+			if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(header))
+			{
+				printf("%s is not a trajectory file.\n", _path);
+				close(fd);
+				return false;
+			}
+
+			length = info.st_size;
+			void* mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (mapping == MAP_FAILED)
+			{
+				printf("Unable to map %s: %s\n", _path, strerror(errno));
+				length = 0;
+				return false;
+			}
+			data = (const uint8_t*)mapping;
+
+			/* scrubbing jumps around, read ahead would page in unseen frames */
+			madvise(mapping, length, MADV_RANDOM);
+
+			memcpy(&header, data, sizeof(header));
+			if (memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0
+			 || header.version != TRAJECTORY_VERSION
+			 || header.keyframe_interval == 0)
+			{
+				printf("%s is not a version %u trajectory file.\n", _path,
+				    TRAJECTORY_VERSION);
+				return false;
+			}
+
+			agents = header.swarm_size + header.predators;
+			previous.resize(4 * agents);
+			decoded = UINT64_MAX;
+
+			if (!read_index())
+				scan();
+
+			if (count == 0)
+			{
+				printf("%s has no frames.\n", _path);
+				return false;
+			}
+
+			return true;
+		}
+
+		uint64_t
+		frames ()
+		{
+			return count;
+		}
+
+		/* side of the world the file was recorded in */
+		float
+		extent ()
+		{
+			return header.position_extent;
+		}
+
+		/* Decode frame _frame into the swarm and the dragonflies. */
+		bool
+		seek (uint64_t _frame, SwarmState& _swarm,
+		    std::vector<Dragonfly>& _dragonflies)
+		{
+			if (_frame >= count)
+				return false;
+
+			uint64_t key = _frame / header.keyframe_interval;
+			if (decoded == UINT64_MAX || _frame < decoded
+			 || key != decoded / header.keyframe_interval)
+			{
+				decoded = key * header.keyframe_interval;
+				next = keyframes[key];
+				if (!decode())
+					return false;
+			}
+
+			while (decoded < _frame)
+			{
+				decoded++;
+				if (!decode())
+					return false;
+			}
+
+			unpack(_swarm, _dragonflies);
+			return true;
+		}
+
+		/* step number of the frame decoded last */
+		uint32_t step;
+
+	private:
+		bool
+		read_index ()
+		{
+			TrajectoryFooter footer;
+			FrameHeader frame_header;
+			uint64_t frames;
+
+			if (length < sizeof(header) + sizeof(footer))
+				return false;
+			memcpy(&footer, data + length - sizeof(footer), sizeof(footer));
+			if (memcmp(footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(footer.magic)) != 0
+			 || footer.index_offset < sizeof(header)
+			 || footer.index_offset + sizeof(frame_header) + sizeof(frames)
+			    > length - sizeof(footer))
+				return false;
+
+			memcpy(&frame_header, data + footer.index_offset, sizeof(frame_header));
+			uint64_t entries = frame_header.size / sizeof(uint64_t);
+			if (frame_header.flags != FRAME_INDEX || entries == 0
+			 || frame_header.size > length - sizeof(footer) - footer.index_offset
+			    - sizeof(frame_header))
+				return false;
+
+			const uint8_t* payload = data + footer.index_offset + sizeof(frame_header);
+			memcpy(&frames, payload, sizeof(frames));
+			keyframes.resize(entries - 1);
+			memcpy(keyframes.data(), payload + sizeof(frames),
+			    keyframes.size() * sizeof(uint64_t));
+
+			if (keyframes.size() != (frames + header.keyframe_interval - 1)
+			    / header.keyframe_interval)
+				return false;
+
+			count = frames;
+			return true;
+		}
+
+		/* Walk the frame headers from the start, up to the first frame that
+		 * is cut short. */
+		void
+		scan ()
+		{
+			uint64_t offset = sizeof(header);
+			FrameHeader frame_header;
+
+			keyframes.clear();
+			count = 0;
+			while (length - offset >= sizeof(frame_header))
+			{
+				memcpy(&frame_header, data + offset, sizeof(frame_header));
+				if (frame_header.size > length - offset - sizeof(frame_header)
+				 || frame_header.flags == FRAME_INDEX)
+					break;
+
+				bool key = (count % header.keyframe_interval) == 0;
+				if (key != ((frame_header.flags & FRAME_KEY) != 0))
+					break;
+				if (key)
+					keyframes.push_back(offset);
+
+				count++;
+				offset += sizeof(frame_header) + frame_header.size;
+			}
+
+			printf("No key frame index, scanned %llu frames.\n",
+			    (unsigned long long)count);
+		}
+
+		/* Decode the frame at next into previous, which holds the values of
+		 * the frame before it. */
+		bool
+		decode ()
+		{
+			FrameHeader frame_header;
+			if (next > length || length - next < sizeof(frame_header))
+				return corrupt();
+
+			memcpy(&frame_header, data + next, sizeof(frame_header));
+			const uint8_t* in = data + next + sizeof(frame_header);
+			if (frame_header.size > (uint64_t)(data + length - in))
+				return corrupt();
+			const uint8_t* end = in + frame_header.size;
+
+			bool quantised = header.flags & TRAJECTORY_QUANTISED;
+			bool key = frame_header.flags & FRAME_KEY;
+			size_t width = quantised ? sizeof(uint16_t) : sizeof(uint32_t);
+
+			if (key != ((decoded % header.keyframe_interval) == 0)
+			 || (key && frame_header.size != previous.size() * width))
+				return corrupt();
+
+			for (unsigned int i = 0; i < previous.size(); i++)
+			{
+				uint32_t value;
+				if (key && quantised)
+				{
+					uint16_t q;
+					memcpy(&q, in, sizeof(q));
+					in += sizeof(q);
+					value = q;
+				}
+				else if (key)
+				{
+					memcpy(&value, in, sizeof(value));
+					in += sizeof(value);
+				}
+				else if (!get_varint(in, end, value))
+					return corrupt();
+				else if (quantised)
+				{
+					int16_t difference = (int16_t)((value >> 1) ^ -(value & 1));
+					value = (uint16_t)(previous[i] + difference);
+				}
+				else
+					value ^= previous[i];
+
+				previous[i] = value;
+			}
+
+			step = frame_header.step;
+			next = end - data;
+			return true;
+		}
+
+		bool
+		corrupt ()
+		{
+			printf("The trajectory file is corrupt at offset %llu.\n",
+			    (unsigned long long)next);
+			decoded = UINT64_MAX;
+			return false;
+		}
+
+		float
+		value (unsigned int _i)
+		{
+			float v;
+
+			if (!(header.flags & TRAJECTORY_QUANTISED))
+				memcpy(&v, &previous[_i], sizeof(v));
+			else if (_i < 2 * agents)
+				v = previous[_i] / 65535.0f * header.position_extent;
+			else
+				v = previous[_i] / 65535.0f * 2.0f * header.velocity_extent
+				    - header.velocity_extent;
+
+			return v;
+		}
+
+		void
+		unpack (SwarmState& _swarm, std::vector<Dragonfly>& _dragonflies)
+		{
+			unsigned int n = header.swarm_size;
+
+			_swarm.resize(n);
+			for (unsigned int i = 0; i < n; i++)
+			{
+				_swarm.position_x[i] = value(i);
+				_swarm.position_y[i] = value(agents + i);
+				_swarm.velocity_x[i] = value(2 * agents + i);
+				_swarm.velocity_y[i] = value(3 * agents + i);
+			}
+
+			_dragonflies.resize(header.predators);
+			for (unsigned int k = 0; k < header.predators; k++)
+			{
+				_dragonflies[k].position.x = value(n + k);
+				_dragonflies[k].position.y = value(agents + n + k);
+				_dragonflies[k].velocity.x = value(2 * agents + n + k);
+				_dragonflies[k].velocity.y = value(3 * agents + n + k);
+			}
+		}
+
+		const uint8_t* data;
+		size_t length;
+		TrajectoryHeader header;
+		unsigned int agents;
+
+		/* file offset of the key frames, one per keyframe_interval frames */
+		std::vector<uint64_t> keyframes;
+		uint64_t count;
+
+		/* values of the frame decoded last, and the offset of the frame after
+		 * it */
+		std::vector<uint32_t> previous;
+		uint64_t decoded;
+		uint64_t next;
+};
+
+/* A checkpoint file is a CheckpointHeader followed by the position x,
+ * position y, velocity x and velocity y of the mosquitoes as floats and then
+ * the dragonflies as they are laid out in memory, in the host's byte order.
+ * Next to the state it keeps what decides how the run continues: the step,
+ * the seed, and the options that change the arithmetic of a step. The
+ * checksum of the state catches files that were cut short or damaged. */
+const char CHECKPOINT_MAGIC[8] = {'K', 'O', 'M', 'A', 'R', 'N', 'O', 'C'};
+const uint32_t CHECKPOINT_VERSION = 3;
+const uint32_t CHECKPOINT_BRUTE_FORCE = 1;
+const uint32_t CHECKPOINT_COMPENSATED = 2;
+
+class CheckpointHeader
+{
+	public:
+		char magic[8];
+		uint32_t version;
+		uint32_t flags;
+		uint32_t swarm_size;
+		uint32_t predators;
+		uint64_t step;
+		uint32_t random_seed;
+		float fear_radius;
+		uint64_t checksum;
+		char kernels[16];
+		Rules rules;
+		uint32_t reserved[4];
+};
+
+static_assert(sizeof(CheckpointHeader) == 128, "checkpoint header layout");
+
+class Checkpoint
+{
+	public:
+		/* Copy the state of the run after _step steps. */
+		void
+		take (SwarmState& _swarm, Pack& _pack, uint64_t _step)
+		{
+			header = CheckpointHeader();
+			memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+			header.version = CHECKPOINT_VERSION;
+			header.flags = (brute_force ? CHECKPOINT_BRUTE_FORCE : 0)
+			    | (compensated ? CHECKPOINT_COMPENSATED : 0);
+			header.swarm_size = _swarm.size();
+			header.predators = _pack.dragonflies.size();
+			header.step = _step;
+			header.random_seed = random_seed;
+			header.fear_radius = fear_radius;
+			header.rules = rules;
+			header.checksum = checksum(_swarm, _pack);
+			strncpy(header.kernels, selected_kernels->name,
+			    sizeof(header.kernels) - 1);
+
+			swarm = _swarm;
+			dragonflies = _pack.dragonflies;
+		}
+
+		/* Write to a temporary file and rename it over _path, so that a run
+		 * stopped while writing leaves the previous checkpoint in place. */
+		bool
+		write (const char* _path)
+		{
+			std::string temporary = std::string(_path) + ".tmp";
+			FILE* file = fopen(temporary.c_str(), "wb");
+			if (file == NULL)
+			{
+				printf("Unable to create %s: %s\n", temporary.c_str(),
+				    strerror(errno));
+				return false;
+			}
+
+			std::vector<float>* columns[4] = {&swarm.position_x,
+			    &swarm.position_y, &swarm.velocity_x, &swarm.velocity_y};
+			bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+			for (auto column : columns)
+				written = written && fwrite(column->data(), sizeof(float),
+				    column->size(), file) == column->size();
+			written = written && fwrite(dragonflies.data(), sizeof(Dragonfly),
+			    dragonflies.size(), file) == dragonflies.size();
+			written = written && fflush(file) == 0 && fsync(fileno(file)) == 0;
+			written = (fclose(file) == 0) && written;
+
+			if (!written || rename(temporary.c_str(), _path) != 0)
+			{
+				printf("Unable to write %s: %s\n", _path, strerror(errno));
+				unlink(temporary.c_str());
+				return false;
+			}
+
+			return true;
+		}
+
+		bool
+		read (const char* _path)
+		{
+			FILE* file = fopen(_path, "rb");
+			if (file == NULL)
+			{
+				printf("Unable to open %s: %s\n", _path, strerror(errno));
+				return false;
+			}
+
+			bool valid = fread(&header, sizeof(header), 1, file) == 1
+			    && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0
+			    && header.version == CHECKPOINT_VERSION
+			    && header.kernels[sizeof(header.kernels) - 1] == '\0';
+
+			/* the sizes have to match the file before anything is allocated */
+			struct stat info;
+			valid = valid && fstat(fileno(file), &info) == 0
+			    && (uint64_t)info.st_size == sizeof(header)
+			    + 4 * sizeof(float) * (uint64_t)header.swarm_size
+			    + sizeof(Dragonfly) * (uint64_t)header.predators;
+
+			if (valid)
+			{
+				swarm.resize(header.swarm_size);
+				dragonflies.resize(header.predators);
+
+				std::vector<float>* columns[4] = {&swarm.position_x,
+				    &swarm.position_y, &swarm.velocity_x, &swarm.velocity_y};
+				for (auto column : columns)
+					valid = valid && fread(column->data(), sizeof(float),
+					    column->size(), file) == column->size();
+				valid = valid && fread(dragonflies.data(), sizeof(Dragonfly),
+				    dragonflies.size(), file) == dragonflies.size();
+			}
+			fclose(file);
+
+			if (valid)
+			{
+				Pack pack(0);
+				pack.dragonflies = dragonflies;
+				valid = checksum(swarm, pack) == header.checksum;
+			}
+
+			if (!valid)
+			{
+				printf("%s is not a version %u checkpoint or is damaged.\n",
+				    _path, CHECKPOINT_VERSION);
+				return false;
+			}
+
+			return true;
+		}
+
+		/* Put the options and the seed of the run back the way they were.
+		 * The kernels and the rules are set up by the caller. */
+		void
+		restore_options ()
+		{
+			brute_force = header.flags & CHECKPOINT_BRUTE_FORCE;
+			compensated = header.flags & CHECKPOINT_COMPENSATED;
+			fear_radius = header.fear_radius;
+			random_seed = header.random_seed;
+		}
+
+		CheckpointHeader header;
+		SwarmState swarm;
+		std::vector<Dragonfly> dragonflies;
+};
+
+/* Writes a checkpoint every _interval steps without holding up the step. The
+ * stepping thread copies the state into the spare checkpoint and a background
+ * thread writes it out. A checkpoint that falls due while the previous one is
+ * still being written is taken after the first step that finds the writer
+ * idle, or from the final state when the run closes. */
+class Checkpointer
+{
+	public:
+		Checkpointer (const char* _path, uint64_t _interval)
+		{
+			path = _path;
+			interval = std::max(_interval, (uint64_t)1);
+			busy = false;
+			pending = false;
+			stop = false;
+			written = 0;
+			writer = std::thread(&Checkpointer::write_checkpoints, this);
+		}
+
+		/* Called by the stepping thread after every step. */
+		void
+		stepped (SwarmState& _swarm, Pack& _pack, uint64_t _step)
+		{
+			if (_step % interval == 0)
+				pending = true;
+
+			if (!pending || busy)
+				return;
+
+			spare.take(_swarm, _pack, _step);
+			pending = false;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy = true;
+			}
+			ready.notify_one();
+		}
+
+		/* Finish the checkpoint being written and stop the writer. A checkpoint
+		 * that fell due while the writer was busy is taken from the final state
+		 * _swarm and _pack of step _step and written before returning. */
+		void
+		close (SwarmState& _swarm, Pack& _pack, uint64_t _step)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			ready.notify_one();
+			writer.join();
+
+			if (pending)
+			{
+				spare.take(_swarm, _pack, _step);
+				pending = false;
+				if (spare.write(path))
+					written++;
+			}
+
+			printf("checkpoints written: %llu\n", (unsigned long long)written);
+		}
+
+	private:
+		void
+		write_checkpoints ()
+		{
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					ready.wait(lock, [this] { return stop || busy; });
+					if (!busy)
+						return;
+				}
+
+				if (spare.write(path))
+					written++;
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					busy = false;
+				}
+			}
+		}
+
+		const char* path;
+		uint64_t interval;
+
+		/* owned by the writer thread while busy, by the stepping thread
+		 * otherwise */
+		Checkpoint spare;
+		std::atomic<bool> busy;
+
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::thread writer;
+		bool stop;
+
+		/* used by the stepping thread only */
+		bool pending;
+
+		/* used by the writer thread only until it stops */
+		uint64_t written;
+};
+
+/* --checkpoint writes the state of the run every --checkpoint-every steps,
+ * NULL writes none */
+Checkpointer* checkpointer = NULL;
+
+/* steps since the start of the run, including those before a restore */
+uint64_t simulation_step = 0;
+
+/* One step of the swarm and the dragonflies, recorded and checkpointed if
+ * asked for. */
+void
+advance (Swarm& _swarm, Pack& _pack)
+{
+	step(_swarm, _pack);
+	move_predators(_pack, _swarm.front());
+	simulation_step++;
+
+	if (recorder != NULL)
+		recorder->record(_swarm.front(), _pack.dragonflies);
+
+	if (checkpointer != NULL)
+		checkpointer->stepped(_swarm.front(), _pack, simulation_step);
+}
+
+/* Run the simulation for a fixed number of steps without SDL and OpenGL and
+ * report the throughput and the checksum of the final state. */
+void
+run_headless (Swarm& _swarm, Pack& _pack, unsigned int _steps)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned int s = 0; s < _steps; s++)
+		advance(_swarm, _pack);
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now()
+	    - start;
+	double agent_steps = (double)_steps * _swarm.front().size();
+
+	printf("steps: %u\n", _steps);
+	printf("seconds: %.3f\n", elapsed.count());
+	printf("steps/sec: %.2f\n", _steps / elapsed.count());
+	printf("ns per agent-step: %.2f\n", elapsed.count() * 1e9 / agent_steps);
+	printf("checksum: %016llx\n",
+	    (unsigned long long)checksum(_swarm.front(), _pack));
+
+	if (recorder != NULL)
+		printf("recording share of the stepping time: %.2f%%\n",
+		    100.0 * recorder->recording / elapsed.count());
+}
+
+/* Step, hunt and draw in turns on one thread. */
+void
+lockstep_loop (Swarm& _swarm, Pack& _pack)
+{
+	is_active = true;
+	SDL_Event event;
+
+	while (!done)
+	{
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+				case SDL_ACTIVEEVENT:
+					if (event.active.state == SDL_APPACTIVE )
+						is_active = (event.active.gain != 0);
+				break;
+
+				case SDL_QUIT:
+					done = true; 
+				break;
+
+				default:
+				break;
+			}
+		}
+
+			
+		if (is_active)
+		{
+			advance(_swarm, _pack);
+
+			draw_scene(_swarm.front(), _pack.dragonflies);
+			SDL_GL_SwapBuffers();
+		}
+	}
+}
+
+/* Lock-free triple buffer between one writer and one reader. The writer fills
+ * back() and publishes it, the reader takes the latest published slot with
+ * acquire() and keeps it in front() until it acquires again. Neither side
+ * ever waits for the other: the third slot holds the latest published state
+ * while the other two are in use. */
+template <typename T>
+class TripleBuffer
+{
+	public:
+		TripleBuffer ()
+		{
+			writer = 0;
+			ready = 1;
+			reader = 2;
+		}
+
+		T&
+		back ()
+		{
+			return slots[writer];
+		}
+
+		void
+		publish ()
+		{
+			writer = ready.exchange(writer | FRESH, std::memory_order_acq_rel)
+			    & INDEX;
+		}
+
+		/* whether a slot newer than front() has been published */
+		bool
+		fresh ()
+		{
+			return ready.load(std::memory_order_acquire) & FRESH;
+		}
+
+		void
+		acquire ()
+		{
+			reader = ready.exchange(reader, std::memory_order_acq_rel) & INDEX;
+		}
+
+		T&
+		front ()
+		{
+			return slots[reader];
+		}
+
+	private:
+		static const unsigned int INDEX = 3;
+		static const unsigned int FRESH = 4;
+
+		T slots[3];
+		unsigned int writer;
+		unsigned int reader;
+
+		/* index of the published slot, FRESH until the reader takes it */
+		std::atomic<unsigned int> ready;
+};
+
+/* A completed state of the simulation, as handed to the renderer. */
+class Snapshot
+{
+	public:
+		SwarmState swarm;
+		std::vector<Dragonfly> dragonflies;
+		std::chrono::steady_clock::time_point time;
+};
+
+Vector2
+lerp (Vector2 _a, Vector2 _b, float _alpha)
+{
+	return Vector2(_a.x + (_b.x - _a.x) * _alpha, _a.y + (_b.y - _a.y) * _alpha);
+}
+
+/* The state between two snapshots, _alpha 0 is _from and 1 is _to. */
+void
+interpolate (Snapshot& _from, Snapshot& _to, float _alpha, Snapshot& _out)
+{
+	_out.swarm.resize(_to.swarm.size());
+	for (unsigned int i = 0; i < _to.swarm.size(); i++)
+	{
+		Mosquito m;
+		m.position = lerp(_from.swarm.position(i), _to.swarm.position(i), _alpha);
+		m.velocity = lerp(_from.swarm.velocity(i), _to.swarm.velocity(i), _alpha);
+		_out.swarm.set(i, m);
+	}
+
+	_out.dragonflies.resize(_to.dragonflies.size());
+	for (unsigned int k = 0; k < _to.dragonflies.size(); k++)
+	{
+		Dragonfly& from = _from.dragonflies[k];
+		Dragonfly& to = _to.dragonflies[k];
+		_out.dragonflies[k].position = lerp(from.position, to.position, _alpha);
+		_out.dragonflies[k].velocity = lerp(from.velocity, to.velocity, _alpha);
+	}
+}
+
+std::atomic<unsigned long long> simulated_steps(0);
+
+/* The simulation thread: step with a fixed timestep of 1/simulation_rate and
+ * publish every completed state. A late step is caught up once, a thread that
+ * cannot keep up at all simply runs as fast as it can. */
+void
+simulate (Swarm& _swarm, Pack& _pack, TripleBuffer<Snapshot>& _snapshots)
+{
+	std::chrono::steady_clock::duration period(0);
+	if (simulation_rate > 0.0)
+		period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		    std::chrono::duration<double>(1.0 / simulation_rate));
+
+	auto next = std::chrono::steady_clock::now();
+
+	while (!done)
+	{
+		if (!is_active)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			next = std::chrono::steady_clock::now();
+			continue;
+		}
+
+		advance(_swarm, _pack);
+
+		Snapshot& snapshot = _snapshots.back();
+		snapshot.swarm = _swarm.front();
+		snapshot.dragonflies = _pack.dragonflies;
+		snapshot.time = std::chrono::steady_clock::now();
+		_snapshots.publish();
+		simulated_steps++;
+
+		next += period;
+		if (next < snapshot.time - period)
+			next = snapshot.time;
+		std::this_thread::sleep_until(next);
+	}
+}
+
+/* Simulation and render rates, printed once a second. */
+class Rates
+{
+	public:
+		Rates ()
+		{
+			start = std::chrono::steady_clock::now();
+			frames = 0;
+			steps = simulated_steps;
+		}
+
+		void
+		frame ()
+		{
+			frames++;
+
+			auto now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - start).count();
+			if (seconds < 1.0)
+				return;
+
+			unsigned long long total = simulated_steps;
+			printf("simulation %.1f steps/s, render %.1f frames/s\n",
+			    (total - steps) / seconds, frames / seconds);
+
+			start = now;
+			frames = 0;
+			steps = total;
+		}
+
+	private:
+		std::chrono::steady_clock::time_point start;
+		unsigned int frames;
+		unsigned long long steps;
+};
+
+/* Draw at display rate while the simulation thread steps at its own rate.
+ * The renderer shows the state between the two latest snapshots, so the
+ * motion stays smooth when the two rates differ, at the cost of one step of
+ * latency. */
+void
+main_loop (Swarm& _swarm, Pack& _pack)
+{
+	if (lockstep)
+	{
+		lockstep_loop(_swarm, _pack);
+		return;
+	}
+
+	TripleBuffer<Snapshot> snapshots;
+	std::thread simulation(simulate, std::ref(_swarm), std::ref(_pack),
+	    std::ref(snapshots));
+
+	Snapshot previous;
+	Snapshot shown;
+	unsigned int received = 0;
+	Rates rates;
+
+	is_active = true;
+	SDL_Event event;
+
+	while (!done)
+	{
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+				case SDL_ACTIVEEVENT:
+					if (event.active.state == SDL_APPACTIVE )
+						is_active = (event.active.gain != 0);
+				break;
+
+				case SDL_QUIT:
+					done = true; 
+				break;
+
+				default:
+				break;
+			}
+		}
+
+		if (!is_active)
+			continue;
+
+		/* the front slot goes back to the writer, keep it for interpolation */
+		if (snapshots.fresh())
+		{
+			if (received > 0)
+				previous = snapshots.front();
+			snapshots.acquire();
+			received++;
+		}
+
+		if (received == 0)
+			continue;
+
+		Snapshot& latest = snapshots.front();
+		if (received == 1)
+			draw_scene(latest.swarm, latest.dragonflies);
+		else
+		{
+			double interval = std::chrono::duration<double>(latest.time
+			    - previous.time).count();
+			double elapsed = std::chrono::duration<double>(
+			    std::chrono::steady_clock::now() - latest.time).count();
+			float alpha = (interval > 0.0) ? std::min(elapsed / interval, 1.0) : 1.0f;
+
+			interpolate(previous, latest, alpha, shown);
+			draw_scene(shown.swarm, shown.dragonflies);
+		}
+
+		SDL_GL_SwapBuffers();
+		rates.frame();
+	}
+
+	simulation.join();
+}
+
+/* Show a recorded trajectory at --sim-rate frames per second, or one frame
+ * per display frame with a rate of 0. Space pauses, the arrow keys step one
+ * frame back or forward, page up and page down jump 1000 frames, and home and
+ * end go to the first and the last frame. */
+void
+play_loop (Player& _player, uint64_t _start)
+{
+	SwarmState swarm;
+	std::vector<Dragonfly> dragonflies;
+	uint64_t last = _player.frames() - 1;
+	double position = std::min(_start, last);
+	uint64_t shown = UINT64_MAX;
+	bool paused = false;
+	auto previous = std::chrono::steady_clock::now();
+
+	is_active = true;
+	SDL_Event event;
+
+	while (!done)
+	{
+		bool seeked = false;
+
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+				case SDL_ACTIVEEVENT:
+					if (event.active.state == SDL_APPACTIVE )
+						is_active = (event.active.gain != 0);
+				break;
+
+				case SDL_QUIT:
+					done = true; 
+				break;
+
+				case SDL_KEYDOWN:
+					seeked = true;
+					switch (event.key.keysym.sym)
+					{
+						case SDLK_SPACE:
+							paused = !paused;
+							seeked = false;
+						break;
+
+						case SDLK_LEFT:
+							position -= 1.0;
+							paused = true;
+						break;
+
+						case SDLK_RIGHT:
+							position += 1.0;
+							paused = true;
+						break;
+
+						case SDLK_PAGEUP:
+							position -= 1000.0;
+						break;
+
+						case SDLK_PAGEDOWN:
+							position += 1000.0;
+						break;
+
+						case SDLK_HOME:
+							position = 0.0;
+						break;
+
+						case SDLK_END:
+							position = last;
+						break;
+
+						default:
+							seeked = false;
+						break;
+					}
+					position = std::max(0.0, std::min(std::floor(position),
+					    (double)last));
+				break;
+
+				default:
+				break;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double>(now - previous).count();
+		previous = now;
+
+		if (!is_active)
+			continue;
+
+		if (!paused && !seeked)
+		{
+			position += (simulation_rate > 0.0) ? elapsed * simulation_rate : 1.0;
+			if (position >= last)
+			{
+				position = last;
+				paused = true;
+			}
+		}
+
+		uint64_t frame = position;
+		if (frame != shown)
+		{
+			if (!_player.seek(frame, swarm, dragonflies))
+				return;
+			shown = frame;
+
+			if (seeked)
+				printf("frame %llu, step %u\n", (unsigned long long)frame,
+				    _player.step);
+		}
+
+		draw_scene(swarm, dragonflies);
+		SDL_GL_SwapBuffers();
+	}
+}
+
+bool
+extract_kernels ()
+{
+	rule_1_kernel = clCreateKernel(program, "rule_1", &err);
+	rule_2_kernel = clCreateKernel(program, "rule_2", &err);
+	rule_3_kernel = clCreateKernel(program, "rule_3", &err);
+	rule_4_kernel = clCreateKernel(program, "rule_4", &err);
+	rule_5_kernel = clCreateKernel(program, "rule_5", &err);
+	single_step_kernel = clCreateKernel(program, "single_step", &err);
+
+	return true;
+}
+
+/* An implementation of the step for --compare, with its own copy of the swarm
+ * and the dragonflies. */
+class Backend
+{
+	public:
+		virtual
+		~Backend ()
+		{
+		}
+
+		/* Step the swarm and move the dragonflies once. */
+		virtual bool
+		step () = 0;
+
+		/* The swarm after the last step, NULL if it cannot be read. */
+		virtual SwarmState*
+		state () = 0;
+
+		const char* name;
+		double seconds;
+};
+
+/* The host step with the given kernels, or with the brute-force rule 2 and
+ * hunt. */
+class HostBackend : public Backend
+{
+	public:
+		HostBackend (const char* _name, Kernels* _kernels, bool _brute_force,
+		    SwarmState& _swarm, Pack& _pack)
+		 : swarm(_swarm.size()), pack(0)
+		{
+			name = _name;
+			seconds = 0.0;
+			kernels = _kernels;
+			brute = _brute_force;
+
+			swarm.front() = _swarm;
+			pack.dragonflies = _pack.dragonflies;
+			pack.index();
+		}
+
+		bool
+		step ()
+		{
+			selected_kernels = kernels;
+			brute_force = brute;
+
+			::step(swarm, pack);
+			move_predators(pack, swarm.front());
+
+			return true;
+		}
+
+		SwarmState*
+		state ()
+		{
+			return &swarm.front();
+		}
+
+	private:
+		Kernels* kernels;
+		bool brute;
+		Swarm swarm;
+		Pack pack;
+};
+
+/* The model of cpu.cpp, stepped by its own step() and move_dragonfly(). It
+ * has a single dragonfly, the default rules and no fear radius. */
+class CpuBackend : public Backend
+{
+	public:
+		CpuBackend (SwarmState& _swarm, Dragonfly& _predator)
+		{
+			name = "cpu.cpp";
+			seconds = 0.0;
+
+			mosquitoes.resize(_swarm.size());
+			for (unsigned int i = 0; i < _swarm.size(); i++)
+			{
+				mosquitoes[i].position = cpu::Vector2(_swarm.position_x[i],
+				    _swarm.position_y[i]);
+				mosquitoes[i].velocity = cpu::Vector2(_swarm.velocity_x[i],
+				    _swarm.velocity_y[i]);
+			}
+			dragonfly.position = cpu::Vector2(_predator.position.x,
+			    _predator.position.y);
+			dragonfly.velocity = cpu::Vector2(_predator.velocity.x,
+			    _predator.velocity.y);
+		}
+
+		bool
+		step ()
+		{
+			mosquitoes = cpu::step(mosquitoes, dragonfly);
+			cpu::move_dragonfly(dragonfly, mosquitoes);
+
+			return true;
+		}
+
+		SwarmState*
+		state ()
+		{
+			swarm.resize(mosquitoes.size());
+			for (unsigned int i = 0; i < mosquitoes.size(); i++)
+			{
+				swarm.position_x[i] = mosquitoes[i].position.x;
+				swarm.position_y[i] = mosquitoes[i].position.y;
+				swarm.velocity_x[i] = mosquitoes[i].velocity.x;
+				swarm.velocity_y[i] = mosquitoes[i].velocity.y;
+			}
+
+			return &swarm;
+		}
+
+	private:
+		std::vector<cpu::Mosquito> mosquitoes;
+		cpu::Dragonfly dragonfly;
+		SwarmState swarm;
+};
+
+/* The kernels of source.cl on the current device, exactly as gpu.cpp steps
+ * them: the shared rules are those of the run, rule 1 and the limit are the
+ * kernels' own. _split runs rule_1 to rule_5 and single_step instead of
+ * fused_step, _tiled the kernels that read the swarm through local memory,
+ * and _pipelined chains the commands of a step by their events and reads the
+ * result without waiting, like a frame of gpu.cpp. The device has a single
+ * predator. */
+class DeviceBackend : public Backend
+{
+	public:
+		DeviceBackend (const char* _name, bool _split, bool _tiled,
+		    bool _pipelined)
+		{
+			name = _name;
+			seconds = 0.0;
+			split = _split;
+			tiled = _tiled;
+			pipelined = _pipelined;
+			std::fill(kernels, kernels + 6, (cl_kernel)NULL);
+			std::fill(rule_mem, rule_mem + 5, (cl_mem)NULL);
+			kernel_count = 0;
+			nearest = NULL;
+			move = NULL;
+			swarm_mem[0] = NULL;
+			swarm_mem[1] = NULL;
+			predator_mem = NULL;
+			nearest_mem = NULL;
+		}
+
+		~DeviceBackend ()
+		{
+			wait();
+
+			for (unsigned int k = 0; k < 6; k++)
+				if (kernels[k] != NULL)
+					clReleaseKernel(kernels[k]);
+			if (nearest != NULL)
+				clReleaseKernel(nearest);
+			if (move != NULL)
+				clReleaseKernel(move);
+
+			cl_mem buffers[] = {swarm_mem[0], swarm_mem[1], predator_mem,
+			    nearest_mem, rule_mem[0], rule_mem[1], rule_mem[2], rule_mem[3],
+			    rule_mem[4]};
+			for (auto b : buffers)
+				if (b != NULL)
+					clReleaseMemObject(b);
+		}
+
+		/* Upload _swarm and _predator to the device built by
+		 * build_cl_program(). */
+		bool
+		open (SwarmState& _swarm, Dragonfly& _predator)
+		{
+			size = _swarm.size();
+
+			/* the step kernels, the last one writes the new swarm */
+			const char* split_names[] = {"rule_1", "rule_2", "rule_3", "rule_4",
+			    "rule_5", "single_step"};
+			const char* tiled_names[] = {"rule_1_tiled", "rule_2_tiled",
+			    "rule_3_tiled", "rule_4", "rule_5", "single_step"};
+			const char* fused_name = tiled ? "fused_step_tiled" : "fused_step";
+			kernel_count = split ? 6 : 1;
+
+			cl_int errors[8];
+			std::fill(errors, errors + 8, CL_SUCCESS);
+			for (unsigned int k = 0; k < kernel_count; k++)
+				kernels[k] = clCreateKernel(program, !split ? fused_name
+				    : tiled ? tiled_names[k] : split_names[k], &errors[k]);
+			nearest = clCreateKernel(program, "nearest_prey", &errors[6]);
+			move = clCreateKernel(program, "move_predator", &errors[7]);
+			for (auto e : errors)
+			{
+				if (e != CL_SUCCESS)
+				{
+					printf("Unable to create the kernels of %s: %d\n", name, e);
+					return false;
+				}
+			}
+
+			/* one work-group size for all kernels, for the tiled ones the tile
+			 * has to fit the local memory */
+			local = 64;
+			for (unsigned int k = 0; k < kernel_count + 2; k++)
+			{
+				cl_kernel kernel = k < kernel_count ? kernels[k]
+				    : k == kernel_count ? nearest : move;
+				size_t limit;
+				if (clGetKernelWorkGroupInfo(kernel, device,
+				    CL_KERNEL_WORK_GROUP_SIZE, sizeof(limit), &limit, NULL)
+				    == CL_SUCCESS)
+					local = std::min(local, limit);
+			}
+
+			cl_ulong local_memory;
+			if (tiled && clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+			    sizeof(local_memory), &local_memory, NULL) == CL_SUCCESS)
+				local = std::min(local,
+				    (size_t)(local_memory / (4 * sizeof(float))));
+
+			if (local == 0)
+			{
+				printf("No work-group size of %s fits this device.\n", name);
+				return false;
+			}
+			global = (size + local - 1) / local * local;
+			groups = global / local;
+
+			/* source.cl keeps the position before the velocity */
+			objects.resize(4 * size);
+			for (unsigned int i = 0; i < size; i++)
+			{
+				objects[4 * i] = _swarm.position_x[i];
+				objects[4 * i + 1] = _swarm.position_y[i];
+				objects[4 * i + 2] = _swarm.velocity_x[i];
+				objects[4 * i + 3] = _swarm.velocity_y[i];
+			}
+			float predator[4] = {_predator.position.x, _predator.position.y,
+			    _predator.velocity.x, _predator.velocity.y};
+
+			cl_int errors_mem[9];
+			std::fill(errors_mem, errors_mem + 9, CL_SUCCESS);
+			size_t bytes = sizeof(float) * objects.size();
+			swarm_mem[0] = clCreateBuffer(context,
+			    CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, bytes, objects.data(),
+			    &errors_mem[0]);
+			swarm_mem[1] = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes,
+			    NULL, &errors_mem[1]);
+			predator_mem = clCreateBuffer(context,
+			    CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, sizeof(predator),
+			    predator, &errors_mem[2]);
+			nearest_mem = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			    (sizeof(float) + sizeof(unsigned int)) * groups, NULL,
+			    &errors_mem[3]);
+
+			/* the split kernels pass the rules on in a float2 per mosquito */
+			for (unsigned int r = 0; split && r < 5; r++)
+				rule_mem[r] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+				    2 * sizeof(float) * size, NULL, &errors_mem[4 + r]);
+
+			for (auto e : errors_mem)
+			{
+				if (e != CL_SUCCESS)
+				{
+					printf("Unable to allocate %s: %d\n", name, e);
+					return false;
+				}
+			}
+
+			/* a candidate is a float and an unsigned int */
+			size_t scratch = (sizeof(float) + sizeof(unsigned int)) * local;
+			size_t tile = 4 * sizeof(float) * local;
+			err = CL_SUCCESS;
+			if (split)
+			{
+				for (unsigned int r = 0; r < 5; r++)
+					err |= clSetKernelArg(kernels[r], 1, sizeof(cl_mem),
+					    &rule_mem[r]);
+				for (unsigned int r = 0; r < 4; r++)
+					err |= clSetKernelArg(kernels[r], 2, sizeof(unsigned int),
+					    &size);
+				for (unsigned int r = 0; tiled && r < 3; r++)
+					err |= clSetKernelArg(kernels[r], 3, tile, NULL);
+				err |= clSetKernelArg(kernels[4], 2, sizeof(cl_mem),
+				    &predator_mem);
+				err |= clSetKernelArg(kernels[4], 3, sizeof(unsigned int),
+				    &size);
+				for (unsigned int r = 0; r < 5; r++)
+					err |= clSetKernelArg(kernels[5], 1 + r, sizeof(cl_mem),
+					    &rule_mem[r]);
+				err |= clSetKernelArg(kernels[5], 7, sizeof(unsigned int),
+				    &size);
+			}
+			else
+			{
+				err |= clSetKernelArg(kernels[0], 1, sizeof(cl_mem),
+				    &predator_mem);
+				err |= clSetKernelArg(kernels[0], 3, sizeof(unsigned int),
+				    &size);
+				if (tiled)
+					err |= clSetKernelArg(kernels[0], 4, tile, NULL);
+			}
+			err |= clSetKernelArg(nearest, 1, sizeof(cl_mem), &predator_mem);
+			err |= clSetKernelArg(nearest, 2, sizeof(cl_mem), &nearest_mem);
+			err |= clSetKernelArg(nearest, 3, sizeof(unsigned int), &size);
+			err |= clSetKernelArg(nearest, 4, scratch, NULL);
+			err |= clSetKernelArg(move, 1, sizeof(cl_mem), &predator_mem);
+			err |= clSetKernelArg(move, 2, sizeof(cl_mem), &nearest_mem);
+			err |= clSetKernelArg(move, 3, sizeof(unsigned int), &groups);
+			err |= clSetKernelArg(move, 4, scratch, NULL);
+			current = 0;
+
+			if (err != CL_SUCCESS)
+			{
+				printf("Unable to set the kernel arguments of %s: %d\n", name,
+				    err);
+				return false;
+			}
+
+			return true;
+		}
+
+		bool
+		step ()
+		{
+			if (!wait())
+				return false;
+
+			/* the step kernels read the current swarm, the last one writes the
+			 * next */
+			err = CL_SUCCESS;
+			for (unsigned int k = 0; k < kernel_count; k++)
+				err |= clSetKernelArg(kernels[k], 0, sizeof(cl_mem),
+				    &swarm_mem[current]);
+			err |= clSetKernelArg(kernels[kernel_count - 1], split ? 6 : 2,
+			    sizeof(cl_mem), &swarm_mem[1 - current]);
+			for (unsigned int k = 0; k < kernel_count; k++)
+				enqueue(kernels[k], global);
+			current = 1 - current;
+
+			/* the predator hunts in the new state */
+			err |= clSetKernelArg(nearest, 0, sizeof(cl_mem),
+			    &swarm_mem[current]);
+			enqueue(nearest, global);
+			err |= clSetKernelArg(move, 0, sizeof(cl_mem), &swarm_mem[current]);
+			enqueue(move, local);
+
+			if (!pipelined)
+				return err == CL_SUCCESS
+				    && clFinish(command_queue) == CL_SUCCESS;
+
+			/* the read waits for the step, the host does not */
+			cl_event event;
+			if (err == CL_SUCCESS)
+				err = clEnqueueReadBuffer(command_queue, swarm_mem[current],
+				    CL_FALSE, 0, sizeof(float) * objects.size(), objects.data(),
+				    1, &events.back(), &event);
+			if (err == CL_SUCCESS)
+				events.push_back(event);
+
+			return err == CL_SUCCESS && clFlush(command_queue) == CL_SUCCESS;
+		}
+
+		SwarmState*
+		state ()
+		{
+			if (pipelined ? !wait() : clEnqueueReadBuffer(command_queue,
+			    swarm_mem[current], CL_TRUE, 0, sizeof(float) * objects.size(),
+			    objects.data(), 0, NULL, NULL) != CL_SUCCESS)
+				return NULL;
+
+			swarm.resize(size);
+			for (unsigned int i = 0; i < size; i++)
+			{
+				swarm.position_x[i] = objects[4 * i];
+				swarm.position_y[i] = objects[4 * i + 1];
+				swarm.velocity_x[i] = objects[4 * i + 2];
+				swarm.velocity_y[i] = objects[4 * i + 3];
+			}
+
+			return &swarm;
+		}
+
+	private:
+		/* Enqueue _kernel over _global work-items, after the previous command
+		 * if pipelined. */
+		void
+		enqueue (cl_kernel _kernel, size_t _global)
+		{
+			if (!pipelined)
+			{
+				err |= clEnqueueNDRangeKernel(command_queue, _kernel, 1, NULL,
+				    &_global, &local, 0, NULL, NULL);
+				return;
+			}
+
+			cl_event event;
+			cl_int error = clEnqueueNDRangeKernel(command_queue, _kernel, 1,
+			    NULL, &_global, &local, events.empty() ? 0 : 1,
+			    events.empty() ? NULL : &events.back(), &event);
+			if (error == CL_SUCCESS)
+				events.push_back(event);
+			err |= error;
+		}
+
+		/* Wait for the commands of the last pipelined step and release them. */
+		bool
+		wait ()
+		{
+			if (events.empty())
+				return true;
+
+			cl_int error = clWaitForEvents(1, &events.back());
+			for (auto e : events)
+				clReleaseEvent(e);
+			events.clear();
+
+			return error == CL_SUCCESS;
+		}
+
+		bool split;
+		bool tiled;
+		bool pipelined;
+
+		unsigned int size;
+		unsigned int groups;
+		size_t local;
+		size_t global;
+		unsigned int current;
+		std::vector<float> objects;
+		SwarmState swarm;
+		std::vector<cl_event> events;
+
+		/* fused_step, or rule_1 to rule_5 and single_step */
+		cl_kernel kernels[6];
+		unsigned int kernel_count;
+		cl_kernel nearest;
+		cl_kernel move;
+		cl_mem swarm_mem[2];
+		cl_mem rule_mem[5];
+		cl_mem predator_mem;
+		cl_mem nearest_mem;
+};
+
+/* Step every backend side by side from _swarm and _pack for _steps steps.
+ * After every step print how far each one has drifted from its reference:
+ * the largest and the root mean square distance between the positions of the
+ * same mosquito. Then print the steps per second of every backend, timing
+ * only the steps. Fails if a backend drifts further than _tolerance from its
+ * reference, or cannot run. The swarm is chaotic, rounding differences grow
+ * with every step, so the bound only means something for a given number of
+ * steps.
+ *
+ * The steps of this program and of cpu.cpp are checked against the scalar
+ * one. The device runs the model of gpu.cpp, so its modes are checked against
+ * the fused kernel, and how far that drifts from the scalar step is only
+ * printed. */
+bool
+compare (SwarmState& _swarm, Pack& _pack, unsigned int _steps,
+    float _tolerance, bool _device)
+{
+	std::vector<Backend*> backends;
+	backends.push_back(new HostBackend("scalar", &kernels[0], false, _swarm,
+	    _pack));
+	backends.push_back(new HostBackend("brute-force", &kernels[0], true, _swarm,
+	    _pack));
+	for (unsigned int i = 1; i < num_kernels; i++)
+		if (kernels_supported(kernels[i]))
+			backends.push_back(new HostBackend(kernels[i].name, &kernels[i],
+			    false, _swarm, _pack));
+
+	/* cpu.cpp has one dragonfly and its rules are fixed */
+	bool single = _pack.dragonflies.size() == 1 && !(fear_radius > 0.0f);
+	if (single && rules == Rules())
+		backends.push_back(new CpuBackend(_swarm, _pack.dragonflies[0]));
+	else
+		printf("cpu.cpp only runs one predator that all mosquitoes fear under "
+		    "the default rules, it takes no part.\n");
+
+	/* every backend is compared with the scalar one unless it says
+	 * otherwise, unchecked ones only print their drift */
+	std::vector<unsigned int> reference(backends.size(), 0);
+	std::vector<bool> checked(backends.size(), true);
+
+	bool passed = true;
+	if (_device && !single)
+	{
+		printf("The device backend needs one predator that all mosquitoes "
+		    "fear.\n");
+		passed = false;
+	}
+	else if (_device)
+	{
+		DeviceBackend* modes[] = {
+		    new DeviceBackend("device-fused", false, false, false),
+		    new DeviceBackend("device-split", true, false, false),
+		    new DeviceBackend("device-tiled", false, true, false),
+		    new DeviceBackend("device-split-tiled", true, true, false),
+		    new DeviceBackend("device-pipelined", false, false, true)};
+
+		unsigned int fused = backends.size();
+		for (auto mode : modes)
+		{
+			backends.push_back(mode);
+			reference.push_back(fused);
+			checked.push_back(true);
+			passed = passed && mode->open(_swarm, _pack.dragonflies[0]);
+		}
+		reference[fused] = 0;
+		checked[fused] = false;
+	}
+
+	unsigned int count = backends.size();
+	std::vector<float> worst(count, 0.0f);
+	std::vector<unsigned int> worst_step(count, 0);
+
+	/* a column is wide enough for its name and the two numbers */
+	std::vector<int> width(count, 23);
+	printf("%-6s", "step");
+	for (unsigned int b = 1; b < count; b++)
+	{
+		std::string title = std::string(backends[b]->name) + " max/rms";
+		width[b] = std::max(width[b], (int)title.size());
+		printf("  %*s", width[b], title.c_str());
+	}
+	printf("\n");
+
+	unsigned int steps = 0;
+	for (unsigned int s = 1; s <= _steps && passed; s++)
+	{
+		for (auto backend : backends)
+		{
+			auto start = std::chrono::steady_clock::now();
+			passed = passed && backend->step();
+			backend->seconds += std::chrono::duration<double>(
+			    std::chrono::steady_clock::now() - start).count();
+		}
+		if (!passed)
+			break;
+		steps = s;
+
+		std::vector<SwarmState*> states(count);
+		for (unsigned int b = 0; b < count && passed; b++)
+		{
+			states[b] = backends[b]->state();
+			passed = states[b] != NULL;
+		}
+		if (!passed)
+			break;
+
+		printf("%-6u", s);
+		for (unsigned int b = 1; b < count; b++)
+		{
+			SwarmState* other = states[b];
+			SwarmState* base = states[reference[b]];
+
+			double largest = 0.0;
+			double squares = 0.0;
+			for (unsigned int i = 0; i < base->size(); i++)
+			{
+				double dx = other->position_x[i] - base->position_x[i];
+				double dy = other->position_y[i] - base->position_y[i];
+				double distance = sqrt(dx * dx + dy * dy);
+
+				/* a NaN is as far off as it gets */
+				if (!(distance <= largest))
+					largest = distance;
+				squares += dx * dx + dy * dy;
+			}
+			double rms = sqrt(squares / base->size());
+			printf("  %*.4g %11.4g", width[b] - 12, largest, rms);
+
+			if (!(largest <= worst[b]))
+			{
+				worst[b] = largest;
+				worst_step[b] = s;
+			}
+		}
+		printf("\n");
+	}
+
+	if (!passed)
+		printf("A backend failed to step or to read back its state.\n");
+
+	for (unsigned int b = 0; b < count; b++)
+	{
+		Backend* backend = backends[b];
+		const char* base = backends[reference[b]]->name;
+		printf("%s: %.2f steps/sec", backend->name,
+		    backend->seconds > 0.0 ? steps / backend->seconds : 0.0);
+		if (b > 0 && worst_step[b] > 0)
+			printf(", largest divergence %g from %s at step %u", worst[b], base,
+			    worst_step[b]);
+		else if (b > 0 && steps > 0)
+			printf(", identical to %s", base);
+		if (b > 0 && !checked[b])
+			printf(", another model and not checked");
+		printf("\n");
+
+		if (b > 0 && checked[b] && !(worst[b] <= _tolerance))
+		{
+			printf("%s diverges from %s by more than %g.\n", backend->name,
+			    base, _tolerance);
+			passed = false;
+		}
+	}
+
+	for (auto backend : backends)
+		delete backend;
+
+	return passed;
+}
+
+int 
+main (int argc, char *argv[])
+{
+	unsigned int size = 20;
+	unsigned int predators = 1;
+	unsigned int steps = 1000;
+	unsigned int seed = time(NULL);
+	bool headless = false;
+
+	/* --brute-force disables the grid, --validate checks it every step,
+	 * --compensated sums the swarm totals with the Neumaier summation,
+	 * --isa forces scalar, sse4.2, avx2 or avx512 kernels,
+	 * --threads sets the number of threads of the step,
+	 * --immediate draws every mosquito with its own glBegin/glEnd,
+	 * --device takes the OpenCL "platform:device" or "auto",
+	 * --predators sets the number of dragonflies and --fear-radius the
+	 * distance within which the mosquitoes fear them,
+	 * --sim-rate sets the steps per second of the simulation thread (0 for
+	 * as fast as possible), --lockstep steps and draws on one thread,
+	 * --record writes the trajectory to a file, --quantise stores it in 16
+	 * bits per value and --delta as differences between key frames,
+	 * --play shows a recorded trajectory instead of simulating, from frame
+	 * --from on, at --sim-rate frames per second,
+	 * --checkpoint writes the state to a file every --checkpoint-every steps
+	 * and --restore continues from such a file with its size, options,
+	 * rules and kernels,
+	 * --rules loads the constants of the rules from a file and --generic runs
+	 * the kernels that read them at run time even for the compiled rules,
+	 * --headless runs --steps steps of a swarm of --size mosquitoes seeded
+	 * with --seed without rendering,
+	 * --compare steps such a swarm with every backend side by side, those of
+	 * the device only with --device, and fails if one drifts further than
+	 * --tolerance from its reference, the scalar step or the fused kernel */
+	const char* isa = NULL;
+	unsigned long threads = 1;
+	const char* record_path = NULL;
+	bool quantised = false;
+	bool delta = false;
+	const char* play_path = NULL;
+	uint64_t from = 0;
+	const char* checkpoint_path = NULL;
+	uint64_t checkpoint_interval = 1000;
+	const char* restore_path = NULL;
+	const char* rules_path = NULL;
+	bool generic = false;
+	bool compare_backends = false;
+	float tolerance = 1.0f;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--brute-force") == 0)
+			brute_force = true;
+		else if (strcmp(argv[i], "--validate") == 0)
+			validate = true;
+		else if (strcmp(argv[i], "--compensated") == 0)
+			compensated = true;
+		else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+			isa = argv[++i];
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+		else if (strcmp(argv[i], "--immediate") == 0)
+			batched = false;
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+			steps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+			device_choice = argv[++i];
+		else if (strcmp(argv[i], "--sim-rate") == 0 && i + 1 < argc)
+			simulation_rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "--lockstep") == 0)
+			lockstep = true;
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			record_path = argv[++i];
+		else if (strcmp(argv[i], "--quantise") == 0)
+			quantised = true;
+		else if (strcmp(argv[i], "--delta") == 0)
+			delta = true;
+		else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+			play_path = argv[++i];
+		else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc)
+			from = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+			checkpoint_path = argv[++i];
+		else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc)
+			checkpoint_interval = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc)
+			restore_path = argv[++i];
+		else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc)
+			rules_path = argv[++i];
+		else if (strcmp(argv[i], "--generic") == 0)
+			generic = true;
+		else if (strcmp(argv[i], "--compare") == 0)
+			compare_backends = true;
+		else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+			tolerance = atof(argv[++i]);
+		else if (strcmp(argv[i], "--predators") == 0 && i + 1 < argc)
+			predators = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--fear-radius") == 0 && i + 1 < argc)
+			fear_radius = atof(argv[++i]);
+		else
+		{
+			printf("Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (rules_path != NULL && !rules.load(rules_path))
+		return 1;
+
+	/* a run continues bit-exactly only with the kernels it started with */
+	Checkpoint* restored = NULL;
+	if (restore_path != NULL)
+	{
+		restored = new Checkpoint();
+		if (!restored->read(restore_path))
+			return 1;
+
+		isa = restored->header.kernels;
+		size = restored->header.swarm_size;
+		predators = restored->header.predators;
+		seed = restored->header.random_seed;
+		rules = restored->header.rules;
+	}
+
+	/* the kernels for the compiled rules only apply if nothing changed them */
+	specialised = !generic && rules == Rules();
+	grid = Grid(rules.separation, rules.world);
+	build_options = rules.options();
+
+	if (!select_kernels(isa))
+		return 1;
+	printf("Using %s kernels%s.\n", selected_kernels->name,
+	    (specialised || selected_kernels->integrate == NULL) ? ""
+	    : " for the rules loaded at run time");
+
+	/* a few threads per core at most, a negative count wraps around */
+	unsigned long max_threads = 4 * std::max(std::thread::hardware_concurrency(),
+	    1u);
+	if (threads == 0 || threads > max_threads)
+	{
+		printf("The step needs between 1 and %lu threads.\n", max_threads);
+		return 1;
+	}
+
+	pool = new ThreadPool(threads);
+	render_pool = lockstep ? pool : new ThreadPool(1);
+
+	/* playback needs neither the simulation nor OpenCL */
+	if (play_path != NULL)
+	{
+		Player player;
+		if (!player.open(play_path))
+			return 1;
+		rules.world = player.extent();
+
+		init_sdl();
+		init_opengl();
+		play_loop(player, from);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (size < 2)
+	{
+		printf("The swarm needs at least 2 mosquitoes.\n");
+		return 1;
+	}
+
+	Swarm swarm(size);
+
+	if (restored == NULL)
+	{
+		random_seed = seed;
+		random_swarm(swarm.front(), seed);
+	}
+
+	Pack pack(restored == NULL ? predators : 0);
+
+	if (restored != NULL)
+	{
+		restored->restore_options();
+		swarm.front() = restored->swarm;
+		pack.dragonflies = restored->dragonflies;
+		pack.index();
+		simulation_step = restored->header.step;
+		printf("Restored step %llu from %s.\n",
+		    (unsigned long long)simulation_step, restore_path);
+
+		delete restored;
+	}
+
+	if (device_choice == NULL)
+		device_choice = getenv("KOMARNO_DEVICE");
+
+	/* the device takes part only if one was named */
+	if (compare_backends)
+	{
+		bool use_device = device_choice != NULL;
+		if (use_device && (!choose_device(size) || !init_cl()
+		 || !build_cl_program("source.cl")))
+			return 1;
+
+		printf("size: %u\nseed: %u\nthreads: %u\npredators: %u\n", size, seed,
+		    pool->size, predators);
+		return compare(swarm.front(), pack, steps, tolerance, use_device)
+		    ? EXIT_SUCCESS : 1;
+	}
+
+	if (checkpoint_path != NULL)
+		checkpointer = new Checkpointer(checkpoint_path, checkpoint_interval);
+
+	/* the initial state is the first frame */
+	if (record_path != NULL)
+	{
+		recorder = new Recorder();
+		if (!recorder->open(record_path, size, predators, quantised, delta,
+		    simulation_step))
+			return 1;
+		recorder->record(swarm.front(), pack.dragonflies);
+	}
+
+	if (headless)
+	{
+		printf("size: %u\nseed: %u\nthreads: %u\npredators: %u\n", size, seed,
+		    pool->size, predators);
+		/* --steps counts from the start of the run, so a restored run stops
+		 * where the uninterrupted one would */
+		run_headless(swarm, pack, steps > simulation_step
+		    ? steps - simulation_step : 0);
+		if (recorder != NULL)
+			recorder->close();
+		if (checkpointer != NULL)
+			checkpointer->close(swarm.front(), pack, simulation_step);
+		return EXIT_SUCCESS;
+	}
+
+	if (!choose_device(size) || !init_cl())
+		return 1;
+
+	/* compile the kernels while the window is being set up */
+	bool built = false;
+	std::thread builder([&] { built = build_cl_program("source.cl"); });
 
   init_sdl();
 	init_opengl();
 
-	main_loop(swarm, dragonfly);
+	builder.join();
+	if (!built)
+		return 1;
+
+	if(!extract_kernels())
+		return 1;
+
+	main_loop(swarm, pack);
+
+	if (recorder != NULL)
+		recorder->close();
+	if (checkpointer != NULL)
+		checkpointer->close(swarm.front(), pack, simulation_step);
 	
 	return EXIT_SUCCESS;	
 }
@@ -6,11 +6,123 @@ typedef struct
 
 typedef mosquito dragonfly;
 
+/* The constants of the rules, defined by gpu.cpp with -D options from its
+ * --rules. Being literals they fold into the kernels, and the divisions by
+ * them are multiplications with their reciprocals. RULE_CENTRE_SCALE and
+ * RULE_ACCELERATION_LIMIT are the kernels' own, see Rules in gpu.cpp. */
+#ifndef RULE_CENTRE_SCALE
+#define RULE_CENTRE_SCALE 1.0f
+#endif
+#ifndef RULE_SEPARATION
+#define RULE_SEPARATION 20.0f
+#endif
+#ifndef RULE_ALIGNMENT
+#define RULE_ALIGNMENT 2.0f
+#endif
+#ifndef RULE_BORDER
+#define RULE_BORDER 20.0f
+#endif
+#ifndef RULE_BORDER_SCALE
+#define RULE_BORDER_SCALE 0.1f
+#endif
+#ifndef RULE_FEAR
+#define RULE_FEAR 60.0f
+#endif
+#ifndef RULE_INERTIA
+#define RULE_INERTIA 10000.0f
+#endif
+#ifndef RULE_ACCELERATION_LIMIT
+#define RULE_ACCELERATION_LIMIT 0.2f
+#endif
+#ifndef RULE_SLOWDOWN
+#define RULE_SLOWDOWN 10.0f
+#endif
+#ifndef RULE_CHASE
+#define RULE_CHASE 35.0f
+#endif
+#ifndef RULE_PREDATOR_SPEED_LIMIT
+#define RULE_PREDATOR_SPEED_LIMIT 0.2f
+#endif
+#ifndef RULE_WORLD
+#define RULE_WORLD 600.0f
+#endif
+
+/* The Philox4x32-10 counter-based generator, the same as philox() in gpu.cpp:
+ * four random words for a counter under the seed and a sequence. */
+void
+philox (uint _counter, uint _seed, uint _sequence, uint* _out)
+{
+	uint c0 = _counter;
+	uint c1 = 0;
+	uint c2 = 0;
+	uint c3 = 0;
+	uint k0 = _seed;
+	uint k1 = _sequence;
+
+	for (uint round = 0; round < 10; round++)
+	{
+		uint hi0 = mul_hi(0xD2511F53u, c0);
+		uint lo0 = 0xD2511F53u * c0;
+		uint hi1 = mul_hi(0xCD9E8D57u, c2);
+		uint lo1 = 0xCD9E8D57u * c2;
+
+		c0 = hi1 ^ c1 ^ k0;
+		c1 = lo1;
+		c2 = hi0 ^ c3 ^ k1;
+		c3 = lo0;
+
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+
+	_out[0] = c0;
+	_out[1] = c1;
+	_out[2] = c2;
+	_out[3] = c3;
+}
+
+/* A velocity component in [-0.5, 0.5) in steps of 0.001, the product is the
+ * only rounding */
+float
+random_velocity (uint _word)
+{
+	return (float)((int)mul_hi(_word, 1000u) - 500) * 0.001f;
+}
+
+/* Mosquito idx of the swarm of _seed, in one of the two corner squares of the
+ * world, the same as Mosquito::random in main.cpp and cpu.cpp. The positions
+ * are drawn on the 600 by 600 grid of the default world and scaled to the
+ * actual one. Sequence 0 is RANDOM_MOSQUITOES of gpu.cpp. */
+__kernel void
+random_swarm (__global mosquito* _swarm, const unsigned int _seed,
+    const unsigned int _swarm_size)
+{
+	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
+	uint words[4];
+	philox(idx, _seed, 0, words);
+
+	_swarm[idx].velocity.x = random_velocity(words[0]);
+	_swarm[idx].velocity.y = random_velocity(words[1]);
+
+	/* the lowest bit picks the square, the high bits the position */
+	float corner = (words[2] & 1) ? 300.0f : 0.0f;
+	_swarm[idx].position.x = ((float)mul_hi(words[2], 300u) + corner) *
+	    (RULE_WORLD / 600.0f);
+	_swarm[idx].position.y = ((float)mul_hi(words[3], 300u) + corner) *
+	    (RULE_WORLD / 600.0f);
+}
+
 __kernel void 
 rule_1 (__global mosquito* _swarm, __global float2* _mass_centre, 
     const unsigned int _swarm_size)
 {
 	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
 	float2 mass_centre = (float2)(0.0f, 0.0f);
 
 	for (unsigned int i = 0; i < _swarm_size; i++)
@@ -20,7 +132,7 @@ rule_1 (__global mosquito* _swarm, __global float2* _mass_centre,
 	}
 
 	mass_centre /= (float)(_swarm_size - 1);
-	_mass_centre[idx] = mass_centre;
+	_mass_centre[idx] = mass_centre * (1.0f / RULE_CENTRE_SCALE);
 }
 
 __kernel void
@@ -28,13 +140,16 @@ rule_2 (__global mosquito* _swarm, __global float2 *_centre,
     const unsigned int _swarm_size)
 {
 	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
 	float2 centre = (float2)(0.0f, 0.0f);
 
 	for (unsigned int i = 0; i < _swarm_size; i++)
 	{
 		if (i == idx) continue;
 		float2 difference = _swarm[i].position - _swarm[idx].position;
-		if (fast_length(difference) < 20.0f)
+		if (fast_length(difference) < RULE_SEPARATION)
 			centre -= difference;
 	}
 
@@ -46,6 +161,9 @@ rule_3 (__global mosquito* _swarm, __global float2 *_velocity,
     const unsigned int _swarm_size)
 {
 	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
 	float2 velocity = (float2)(0.0f, 0.0f);
 
 	for (unsigned int i = 0; i < _swarm_size; i++)
@@ -55,40 +173,151 @@ rule_3 (__global mosquito* _swarm, __global float2 *_velocity,
 	}
 	velocity /= (float)(_swarm_size - 1);
 	velocity = _swarm[idx].velocity - velocity;
-	velocity /= 2.0f;
+	velocity *= 1.0f / RULE_ALIGNMENT;
 
 	_velocity[idx] = velocity;
 }
 
+/* Tiled variants of the all-pairs rules, the usual N-body layout. The
+ * work-group loads a tile of get_local_size(0) mosquitoes into local memory
+ * and every work-item consumes it before the next tile is loaded, so each
+ * mosquito is read from global memory once per work-group instead of once
+ * per work-item. The NDRange is padded to a multiple of the work-group size,
+ * the padding work-items help with the loads but write nothing. The pairs
+ * are visited in the same order as in the untiled kernels. */
+
+/* Load the tile starting at mosquito _base. Returns the number of mosquitoes
+ * in it, which is smaller than the work-group size only for the last tile.
+ * Must be reached by all work-items of the work-group. */
+unsigned int
+load_tile (__global mosquito* _swarm, __local mosquito* _tile,
+    unsigned int _base, const unsigned int _swarm_size)
+{
+	unsigned int lid = get_local_id(0);
+	unsigned int count = min((unsigned int)get_local_size(0), _swarm_size - _base);
+
+	/* the previous tile is consumed by everyone */
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid < count)
+		_tile[lid] = _swarm[_base + lid];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return count;
+}
+
 __kernel void
-rule_4 (__global mosquito* _swarm, __global float2 *_border_force,
-    const unsigned int _swarm_size)
+rule_1_tiled (__global mosquito* _swarm, __global float2* _mass_centre,
+    const unsigned int _swarm_size, __local mosquito* _tile)
+{
+	unsigned int idx = get_global_id(0);
+	float2 mass_centre = (float2)(0.0f, 0.0f);
+
+	for (unsigned int base = 0; base < _swarm_size; base += get_local_size(0))
+	{
+		unsigned int count = load_tile(_swarm, _tile, base, _swarm_size);
+		for (unsigned int j = 0; j < count; j++)
+		{
+			if (base + j == idx) continue;
+			mass_centre += _tile[j].position;
+		}
+	}
+
+	if (idx >= _swarm_size)
+		return;
+
+	mass_centre /= (float)(_swarm_size - 1);
+	_mass_centre[idx] = mass_centre * (1.0f / RULE_CENTRE_SCALE);
+}
+
+__kernel void
+rule_2_tiled (__global mosquito* _swarm, __global float2 *_centre,
+    const unsigned int _swarm_size, __local mosquito* _tile)
+{
+	unsigned int idx = get_global_id(0);
+	float2 position = (idx < _swarm_size) ? _swarm[idx].position
+	    : (float2)(0.0f, 0.0f);
+	float2 centre = (float2)(0.0f, 0.0f);
+
+	for (unsigned int base = 0; base < _swarm_size; base += get_local_size(0))
+	{
+		unsigned int count = load_tile(_swarm, _tile, base, _swarm_size);
+		for (unsigned int j = 0; j < count; j++)
+		{
+			if (base + j == idx) continue;
+			float2 difference = _tile[j].position - position;
+			if (fast_length(difference) < RULE_SEPARATION)
+				centre -= difference;
+		}
+	}
+
+	if (idx >= _swarm_size)
+		return;
+
+	_centre[idx] = centre;
+}
+
+__kernel void
+rule_3_tiled (__global mosquito* _swarm, __global float2 *_velocity,
+    const unsigned int _swarm_size, __local mosquito* _tile)
 {
 	unsigned int idx = get_global_id(0);
+	float2 velocity = (float2)(0.0f, 0.0f);
+
+	for (unsigned int base = 0; base < _swarm_size; base += get_local_size(0))
+	{
+		unsigned int count = load_tile(_swarm, _tile, base, _swarm_size);
+		for (unsigned int j = 0; j < count; j++)
+		{
+			if (base + j == idx) continue;
+			velocity += _tile[j].velocity;
+		}
+	}
+
+	if (idx >= _swarm_size)
+		return;
+
+	velocity /= (float)(_swarm_size - 1);
+	velocity = _swarm[idx].velocity - velocity;
+	velocity *= 1.0f / RULE_ALIGNMENT;
+
+	_velocity[idx] = velocity;
+}
+
+float2
+border_force (float2 _position)
+{
 	float2 top_velocity = (float2)(0.0f, 0.0f);
 	float2 bottom_velocity = (float2)(0.0f, 0.0f);
 	float2 left_velocity = (float2)(0.0f, 0.0f);
 	float2 right_velocity = (float2)(0.0f, 0.0f);
 
-	if (_swarm[idx].position.x == 0.0f 
-	 || _swarm[idx].position.y == 0.0f 
-	 || _swarm[idx].position.x == 600.0f 
-	 || _swarm[idx].position.y == 600.0f)
-	{
-		_border_force[idx] = (float2)(0.0f, 0.0f);
-		return;
-	}
+	if (_position.x == 0.0f 
+	 || _position.y == 0.0f 
+	 || _position.x == RULE_WORLD 
+	 || _position.y == RULE_WORLD)
+		return (float2)(0.0f, 0.0f);
 
-	top_velocity.y = fabs(20.0f / _swarm[idx].position.y);	
-	bottom_velocity.y = -fabs(20.0f / (_swarm[idx].position.y - 600.0f));	
-	left_velocity.x = fabs(20.0f / _swarm[idx].position.x);	
-	right_velocity.x = -fabs(20.0f / (_swarm[idx].position.x - 600.0f));	
+	top_velocity.y = fabs(RULE_BORDER / _position.y);	
+	bottom_velocity.y = -fabs(RULE_BORDER / (_position.y - RULE_WORLD));	
+	left_velocity.x = fabs(RULE_BORDER / _position.x);	
+	right_velocity.x = -fabs(RULE_BORDER / (_position.x - RULE_WORLD));	
 
 	float2 result = top_velocity + bottom_velocity + left_velocity +
 	    right_velocity;
-	result /= 0.1f;
+	result *= 1.0f / RULE_BORDER_SCALE;
 
-	_border_force[idx] = result;
+	return result;
+}
+
+__kernel void
+rule_4 (__global mosquito* _swarm, __global float2 *_border_force,
+    const unsigned int _swarm_size)
+{
+	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
+	_border_force[idx] = border_force(_swarm[idx].position);
 }
 
 __kernel void
@@ -96,28 +325,314 @@ rule_5 (__global mosquito* _swarm, __global float2 *_fear,
     __global dragonfly *_predator, const unsigned int _swarm_size)
 {
 	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
 	float2 result = _swarm[idx].position - _predator->position;
-	result /= 60.0f;
+	result *= 1.0f / RULE_FEAR;
 
 	_fear[idx] = result;
 }
 
+void
+integrate (__global mosquito* _old, __global mosquito* _new, float2 _velocity)
+{
+	_velocity *= 1.0f / RULE_INERTIA;
+
+	if (fast_length(_velocity) > RULE_ACCELERATION_LIMIT)
+		_velocity = normalize(_velocity) * RULE_ACCELERATION_LIMIT;
+
+	_new->velocity = _old->velocity + _velocity;
+	_new->position = _old->position + _old->velocity + _velocity;
+}
+
 __kernel void
 single_step (__global mosquito* _swarm, __global float2* _rule_1, 
     __global float2* _rule_2, __global float2* _rule_3, 
     __global float2* _rule_4, __global float2* _rule_5, 
-    __global mosquito* _new_swarm)
+    __global mosquito* _new_swarm, const unsigned int _swarm_size)
 {
 	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
 	float2 velocity = _rule_1[idx] + _rule_2[idx] + _rule_3[idx] + _rule_4[idx]
 	    + _rule_5[idx];
-	velocity /= 10000.0f;
 
-	if (fast_length(velocity) > 0.2f)
-		velocity = normalize(velocity) * 0.2f;
+	integrate(&_swarm[idx], &_new_swarm[idx], velocity);
+}
+
+/* All five rules and the integration in one launch. The rule contributions
+ * stay in registers and are combined exactly as in single_step, so the result
+ * matches the split kernels. */
+__kernel void
+fused_step (__global mosquito* _swarm, __global dragonfly *_predator,
+    __global mosquito* _new_swarm, const unsigned int _swarm_size)
+{
+	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
+	float2 position = _swarm[idx].position;
+	float2 mass_centre = (float2)(0.0f, 0.0f);
+	float2 centre = (float2)(0.0f, 0.0f);
+	float2 velocity = (float2)(0.0f, 0.0f);
+
+	for (unsigned int i = 0; i < _swarm_size; i++)
+	{
+		if (i == idx) continue;
+
+		float2 other = _swarm[i].position;
+		mass_centre += other;
+
+		float2 difference = other - position;
+		if (fast_length(difference) < RULE_SEPARATION)
+			centre -= difference;
+
+		velocity += _swarm[i].velocity;
+	}
+
+	mass_centre /= (float)(_swarm_size - 1);
+	mass_centre *= 1.0f / RULE_CENTRE_SCALE;
+
+	velocity /= (float)(_swarm_size - 1);
+	velocity = _swarm[idx].velocity - velocity;
+	velocity *= 1.0f / RULE_ALIGNMENT;
+
+	float2 fear = position - _predator->position;
+	fear *= 1.0f / RULE_FEAR;
+
+	integrate(&_swarm[idx], &_new_swarm[idx], mass_centre + centre + velocity
+	    + border_force(position) + fear);
+}
+
+/* fused_step reading the swarm through local memory tiles, see load_tile. */
+__kernel void
+fused_step_tiled (__global mosquito* _swarm, __global dragonfly *_predator,
+    __global mosquito* _new_swarm, const unsigned int _swarm_size,
+    __local mosquito* _tile)
+{
+	unsigned int idx = get_global_id(0);
+	float2 position = (idx < _swarm_size) ? _swarm[idx].position
+	    : (float2)(0.0f, 0.0f);
+	float2 mass_centre = (float2)(0.0f, 0.0f);
+	float2 centre = (float2)(0.0f, 0.0f);
+	float2 velocity = (float2)(0.0f, 0.0f);
+
+	for (unsigned int base = 0; base < _swarm_size; base += get_local_size(0))
+	{
+		unsigned int count = load_tile(_swarm, _tile, base, _swarm_size);
+		for (unsigned int j = 0; j < count; j++)
+		{
+			if (base + j == idx) continue;
+
+			float2 other = _tile[j].position;
+			mass_centre += other;
+
+			float2 difference = other - position;
+			if (fast_length(difference) < RULE_SEPARATION)
+				centre -= difference;
+
+			velocity += _tile[j].velocity;
+		}
+	}
+
+	if (idx >= _swarm_size)
+		return;
+
+	mass_centre /= (float)(_swarm_size - 1);
+	mass_centre *= 1.0f / RULE_CENTRE_SCALE;
+
+	velocity /= (float)(_swarm_size - 1);
+	velocity = _swarm[idx].velocity - velocity;
+	velocity *= 1.0f / RULE_ALIGNMENT;
+
+	float2 fear = position - _predator->position;
+	fear *= 1.0f / RULE_FEAR;
+
+	integrate(&_swarm[idx], &_new_swarm[idx], mass_centre + centre + velocity
+	    + border_force(position) + fear);
+}
+
+/* The hunt of the predator on the device. nearest_prey reduces the mosquitoes
+ * of every work-group to the one nearest to the predator, move_predator
+ * reduces these candidates in a single work-group and moves the predator
+ * towards the winner, so a step needs nothing from the host. Ties go to the
+ * lower index, as in the linear scan of the host. */
+typedef struct
+{
+	float distance;
+	unsigned int index;
+} candidate;
+
+candidate
+closer (candidate _a, candidate _b)
+{
+	if (_b.distance < _a.distance
+	 || (_b.distance == _a.distance && _b.index < _a.index))
+		return _b;
+
+	return _a;
+}
+
+/* Reduce _scratch[0 .. get_local_size(0)) to _scratch[0]. The work-group size
+ * need not be a power of two. Must be reached by all work-items of the
+ * work-group. */
+void
+reduce_candidates (__local candidate* _scratch)
+{
+	unsigned int lid = get_local_id(0);
+
+	for (unsigned int n = get_local_size(0); n > 1; n = (n + 1) / 2)
+	{
+		unsigned int half = (n + 1) / 2;
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid + half < n)
+			_scratch[lid] = closer(_scratch[lid], _scratch[lid + half]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+__kernel void
+nearest_prey (__global mosquito* _swarm, __global dragonfly *_predator,
+    __global candidate* _nearest, const unsigned int _swarm_size,
+    __local candidate* _scratch)
+{
+	unsigned int idx = get_global_id(0);
+	candidate own = {INFINITY, UINT_MAX};
+
+	if (idx < _swarm_size)
+	{
+		float2 difference = _predator->position - _swarm[idx].position;
+		own.distance = sqrt(difference.x * difference.x
+		    + difference.y * difference.y);
+		own.index = idx;
+	}
+
+	_scratch[get_local_id(0)] = own;
+	reduce_candidates(_scratch);
+
+	if (get_local_id(0) == 0)
+		_nearest[get_group_id(0)] = _scratch[0];
+}
+
+/* Turn the predator towards _prey and move it. */
+void
+chase (__global mosquito* _prey, __global dragonfly *_predator)
+{
+	float2 closest = _predator->position - _prey->position;
+	closest *= -1.0f / RULE_CHASE;
+
+	float2 velocity = _predator->velocity + closest;
+	if (length(velocity) > RULE_PREDATOR_SPEED_LIMIT)
+		velocity *= 1.0f / RULE_SLOWDOWN;
+
+	_predator->velocity = velocity;
+	_predator->position += velocity;
+}
+
+__kernel void
+move_predator (__global mosquito* _swarm, __global dragonfly *_predator,
+    __global candidate* _nearest, const unsigned int _groups,
+    __local candidate* _scratch)
+{
+	unsigned int lid = get_local_id(0);
+	candidate best = {INFINITY, UINT_MAX};
+
+	for (unsigned int g = lid; g < _groups; g += get_local_size(0))
+		best = closer(best, _nearest[g]);
+
+	_scratch[lid] = best;
+	reduce_candidates(_scratch);
 
-	_new_swarm[idx].velocity = _swarm[idx].velocity + velocity;
-	_new_swarm[idx].position = _swarm[idx].position + _swarm[idx].velocity 
-	    + velocity;
+	if (lid == 0)
+		chase(&_swarm[_scratch[0].index], _predator);
 }
 
+/* Factors of the five rules of one swarm of an ensemble. */
+typedef struct
+{
+	float rule_1;
+	float rule_2;
+	float rule_3;
+	float rule_4;
+	float rule_5;
+} weights;
+
+/* fused_step for an ensemble of swarms of _swarm_size mosquitoes, stored one
+ * after the other. Dimension 1 of the NDRange is the swarm, each with its
+ * own predator and rule weights. */
+__kernel void
+ensemble_step (__global mosquito* _swarms, __global dragonfly *_predators,
+    __global mosquito* _new_swarms, __global weights* _weights,
+    const unsigned int _swarm_size)
+{
+	unsigned int idx = get_global_id(0);
+	if (idx >= _swarm_size)
+		return;
+
+	unsigned int offset = get_global_id(1) * _swarm_size;
+	__global mosquito* swarm = _swarms + offset;
+	weights w = _weights[get_global_id(1)];
+
+	float2 position = swarm[idx].position;
+	float2 mass_centre = (float2)(0.0f, 0.0f);
+	float2 centre = (float2)(0.0f, 0.0f);
+	float2 velocity = (float2)(0.0f, 0.0f);
+
+	for (unsigned int i = 0; i < _swarm_size; i++)
+	{
+		if (i == idx) continue;
+
+		float2 other = swarm[i].position;
+		mass_centre += other;
+
+		float2 difference = other - position;
+		if (fast_length(difference) < RULE_SEPARATION)
+			centre -= difference;
+
+		velocity += swarm[i].velocity;
+	}
+
+	mass_centre /= (float)(_swarm_size - 1);
+	mass_centre *= 1.0f / RULE_CENTRE_SCALE;
+
+	velocity /= (float)(_swarm_size - 1);
+	velocity = swarm[idx].velocity - velocity;
+	velocity *= 1.0f / RULE_ALIGNMENT;
+
+	float2 fear = position - _predators[get_global_id(1)].position;
+	fear *= 1.0f / RULE_FEAR;
+
+	integrate(&swarm[idx], &_new_swarms[offset + idx],
+	    mass_centre * w.rule_1 + centre * w.rule_2 + velocity * w.rule_3
+	    + border_force(position) * w.rule_4 + fear * w.rule_5);
+}
+
+/* nearest_prey and move_predator for an ensemble: work-group g hunts in swarm
+ * g, its work-items stride through the swarm. */
+__kernel void
+ensemble_hunt (__global mosquito* _swarms, __global dragonfly *_predators,
+    const unsigned int _swarm_size, __local candidate* _scratch)
+{
+	unsigned int lid = get_local_id(0);
+	__global mosquito* swarm = _swarms + get_group_id(1) * _swarm_size;
+	__global dragonfly* predator = _predators + get_group_id(1);
+	candidate best = {INFINITY, UINT_MAX};
+
+	for (unsigned int i = lid; i < _swarm_size; i += get_local_size(0))
+	{
+		float2 difference = predator->position - swarm[i].position;
+		candidate own = {sqrt(difference.x * difference.x
+		    + difference.y * difference.y), i};
+		best = closer(best, own);
+	}
+
+	_scratch[lid] = best;
+	reduce_candidates(_scratch);
+
+	if (lid == 0)
+		chase(&swarm[_scratch[0].index], predator);
+}